@@ -16,6 +16,7 @@ LOCAL_SRC_FILES := \
     verifier.c \
     encryptedfs_provisioning.c \
     mounts.c \
+    dirscan.c \
 	extendedcommands.c \
 	nandroid.c \
     reboot.c \
@@ -29,18 +29,36 @@ int ui_text_visible();        // returns >0 if text log is currently visible
 void ui_show_text(int visible);
 void ui_clear_key_queue();
 
+// Like ui_wait_key(), but also returns UI_WAKE once ui_wake() has been
+// called (from any thread) since the last such return.  Clearing the key
+// queue doesn't drop a wake.
+#define UI_WAKE -1
+int ui_wait_key_or_wake();
+void ui_wake();
+
 // Write a message to the on-screen log shown with Alt-L (also to stderr).
 // The screen is small, and users may need to report these messages to support,
 // so keep the output short and not too cryptic.
 void ui_print(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 
 void ui_reset_text_col();
+// Wait until everything ui_print()ed so far is on the screen.  Text is
+// drawn asynchronously, so call this before rebooting or before changes
+// to the screen that must come after it.
+void ui_flush();
 void ui_set_show_text(int value);
 
 // Display some header text followed by a menu of items, which appears
 // at the top of the screen (in place of any scrolling ui_print()
 // output, if necessary).
 int ui_start_menu(char** headers, char** items, int initial_selection);
+// Like ui_start_menu(), but with item_count items that are asked for with
+// get_item(index, cookie) only when drawn, so the list can be very long.
+// The strings must stay valid until ui_end_menu().
+typedef const char* (*ui_menu_item_fn)(int index, void* cookie);
+int ui_start_menu_items(char** headers, int item_count,
+                        ui_menu_item_fn get_item, void* cookie,
+                        int initial_selection);
 // Set the menu highlight to the given index, and return it (capped to
 // the range [0..numitems).
 int ui_menu_select(int sel);
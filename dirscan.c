@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "common.h"
+#include "dirscan.h"
+
+/* Least time between two ui_wake() calls while entries keep coming */
+#define DIRSCAN_WAKE_MS 250
+
+struct DirScan {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* something found, or done */
+
+    DIR *dir;
+    char *path;
+    dirscan_filter_fn filter;
+    void *cookie;
+
+    /* found but not collected yet; all of this under lock */
+    DirScanList dirs, files;
+    int done, stop, notify;
+};
+
+static long long now_ms(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static int list_reserve(DirScanList *list, int count)
+{
+    if (list->count + count <= list->alloc) return 0;
+    int alloc = list->alloc ? list->alloc : 32;
+    while (alloc < list->count + count) alloc *= 2;
+    char **names = realloc(list->names, alloc * sizeof(char *));
+    if (names == NULL) return -1;
+    list->names = names;
+    list->alloc = alloc;
+    return 0;
+}
+
+static void list_add(DirScanList *list, const char *name, int slash)
+{
+    int len = strlen(name);
+    char *copy = malloc(len + 2);
+    if (copy == NULL || list_reserve(list, 1)) {
+        LOGE("out of memory listing %s\n", name);
+        free(copy);
+        return;
+    }
+    memcpy(copy, name, len);
+    if (slash) copy[len++] = '/';
+    copy[len] = '\0';
+    list->names[list->count++] = copy;
+}
+
+/* Moves all of from onto the end of to. */
+static void list_move(DirScanList *to, DirScanList *from)
+{
+    if (from->count == 0) return;
+    if (list_reserve(to, from->count)) {
+        LOGE("out of memory listing directory\n");
+        return;     // try again on the next collect
+    }
+    memcpy(to->names + to->count, from->names, from->count * sizeof(char *));
+    to->count += from->count;
+    from->count = 0;
+}
+
+void dirscan_free_list(DirScanList *list)
+{
+    int i;
+    for (i = 0; i < list->count; ++i) free(list->names[i]);
+    free(list->names);
+    list->names = NULL;
+    list->count = list->alloc = 0;
+}
+
+static void *scan_thread(void *cookie)
+{
+    DirScan *scan = (DirScan *) cookie;
+    long long last_wake = now_ms();
+    struct dirent *de;
+    int wake;
+
+    while ((de = readdir(scan->dir)) != NULL) {
+        int kind = scan->filter(scan->path, de, scan->cookie);
+
+        pthread_mutex_lock(&scan->lock);
+        if (scan->stop) {
+            pthread_mutex_unlock(&scan->lock);
+            break;
+        }
+        wake = 0;
+        if (kind != DIRSCAN_SKIP) {
+            if (kind == DIRSCAN_DIR) list_add(&scan->dirs, de->d_name, 1);
+            else list_add(&scan->files, de->d_name, 0);
+            pthread_cond_broadcast(&scan->cond);
+            wake = scan->notify && now_ms() - last_wake >= DIRSCAN_WAKE_MS;
+        }
+        pthread_mutex_unlock(&scan->lock);
+
+        if (wake) {
+            ui_wake();
+            last_wake = now_ms();
+        }
+    }
+    closedir(scan->dir);
+    scan->dir = NULL;
+
+    pthread_mutex_lock(&scan->lock);
+    scan->done = 1;
+    pthread_cond_broadcast(&scan->cond);
+    wake = scan->notify && !scan->stop;
+    pthread_mutex_unlock(&scan->lock);
+    if (wake) ui_wake();
+    return NULL;
+}
+
+DirScan *dirscan_start(const char *path, dirscan_filter_fn filter,
+                       void *cookie)
+{
+    DirScan *scan = calloc(1, sizeof(DirScan));
+    if (scan == NULL) return NULL;
+
+    scan->path = strdup(path);
+    scan->dir = opendir(path);
+    if (scan->path == NULL || scan->dir == NULL) goto fail;
+    scan->filter = filter;
+    scan->cookie = cookie;
+    pthread_mutex_init(&scan->lock, NULL);
+    pthread_cond_init(&scan->cond, NULL);
+
+    if (pthread_create(&scan->thread, NULL, scan_thread, scan) != 0) {
+        pthread_cond_destroy(&scan->cond);
+        pthread_mutex_destroy(&scan->lock);
+        goto fail;
+    }
+    return scan;
+
+fail:
+    if (scan->dir != NULL) closedir(scan->dir);
+    free(scan->path);
+    free(scan);
+    return NULL;
+}
+
+int dirscan_collect(DirScan *scan, DirScanList *dirs, DirScanList *files,
+                    int wait)
+{
+    pthread_mutex_lock(&scan->lock);
+    while (wait && !scan->done &&
+           scan->dirs.count == 0 && scan->files.count == 0) {
+        pthread_cond_wait(&scan->cond, &scan->lock);
+    }
+    list_move(dirs, &scan->dirs);
+    list_move(files, &scan->files);
+    int done = scan->done && scan->dirs.count == 0 && scan->files.count == 0;
+    pthread_mutex_unlock(&scan->lock);
+    return done;
+}
+
+void dirscan_notify(DirScan *scan, int on)
+{
+    pthread_mutex_lock(&scan->lock);
+    scan->notify = on;
+    // whatever came in (or the end) while notify was off hasn't been
+    // signalled, and won't be by the scan
+    int wake = on && (scan->done ||
+                      scan->dirs.count > 0 || scan->files.count > 0);
+    pthread_mutex_unlock(&scan->lock);
+    if (wake) ui_wake();
+}
+
+void dirscan_end(DirScan *scan)
+{
+    pthread_mutex_lock(&scan->lock);
+    scan->stop = 1;
+    pthread_mutex_unlock(&scan->lock);
+    pthread_join(scan->thread, NULL);
+
+    pthread_cond_destroy(&scan->cond);
+    pthread_mutex_destroy(&scan->lock);
+    dirscan_free_list(&scan->dirs);
+    dirscan_free_list(&scan->files);
+    free(scan->path);
+    free(scan);
+}
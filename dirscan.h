@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RECOVERY_DIRSCAN_H_
+#define RECOVERY_DIRSCAN_H_
+
+#include <dirent.h>
+
+/* Reads a directory on a thread of its own, so that a menu of what is in
+ * it can open before all of it has been read.
+ */
+typedef struct DirScan DirScan;
+
+/* What a filter makes of a directory entry. */
+#define DIRSCAN_SKIP    0
+#define DIRSCAN_DIR     1
+#define DIRSCAN_FILE    2
+
+typedef int (*dirscan_filter_fn)(const char *path, const struct dirent *de,
+                                 void *cookie);
+
+/* Names of the entries a scan found, each malloc()ed. */
+typedef struct {
+    char **names;
+    int count;
+    int alloc;
+} DirScanList;
+
+/* Starts reading path; NULL if it can't be opened.  filter() is called
+ * on the scan's thread.
+ */
+DirScan *dirscan_start(const char *path, dirscan_filter_fn filter,
+                       void *cookie);
+
+/* Appends what was found since the last call to dirs (with a trailing
+ * '/') and files, and returns 1 once the whole directory has been read.
+ * If wait is set, first waits for something new or the end.
+ */
+int dirscan_collect(DirScan *scan, DirScanList *dirs, DirScanList *files,
+                    int wait);
+
+/* While on, the scan calls ui_wake() now and then as it finds entries,
+ * and once when it's done.  Turning it on calls ui_wake() right away if
+ * there is already something to collect, or the scan is done.
+ */
+void dirscan_notify(DirScan *scan, int on);
+
+/* Stops the scan if it's still going, and frees it along with anything
+ * not collected.
+ */
+void dirscan_end(DirScan *scan);
+
+void dirscan_free_list(DirScanList *list);
+
+#endif  // RECOVERY_DIRSCAN_H_
@@ -36,7 +36,9 @@
 #include "extendedcommands.h"
 #include "nandroid.h"
 #include "mounts.h"
+#include "dirscan.h"
 #include "flashutils/flashutils.h"
+#include "mmcutils/mmcutils.h"
 #include "edify/expr.h"
 
 int signature_check_enabled = 1;
@@ -131,153 +133,134 @@ void free_string_array(char** array)
     free(array);
 }
 
-char** gather_files(const char* directory, const char* fileExtensionOrDirectory, int* numFiles)
+static int compare_string(const void* a, const void* b)
 {
-    char path[PATH_MAX] = "";
-    DIR *dir;
-    struct dirent *de;
-    int total = 0;
-    int i;
-    char** files = NULL;
-    int pass;
-    *numFiles = 0;
-    int dirLen = strlen(directory);
-
-    dir = opendir(directory);
-    if (dir == NULL) {
-        ui_print("无法打开目录.\n");
-        return NULL;
-    }
-
-    int extension_length = 0;
-    if (fileExtensionOrDirectory != NULL)
-        extension_length = strlen(fileExtensionOrDirectory);
+    return strcmp(*(const char**)a, *(const char**)b);
+}
 
-    int isCounting = 1;
-    i = 0;
-    for (pass = 0; pass < 2; pass++) {
-        while ((de=readdir(dir)) != NULL) {
-            // skip hidden files
-            if (de->d_name[0] == '.')
-                continue;
+// Which entries choose_file_menu() lists: directories to go into, and
+// files with the extension (cookie), or with none, directories to choose.
+static int file_menu_filter(const char* path, const struct dirent* de, void* cookie)
+{
+    const char* extension = (const char*) cookie;
+    int name_length = strlen(de->d_name);
 
-            // NULL means that we are gathering directories, so skip this
-            if (fileExtensionOrDirectory != NULL)
-            {
-                // make sure that we can have the desired extension (prevent seg fault)
-                if (strlen(de->d_name) < extension_length)
-                    continue;
-                // compare the extension
-                if (strcmp(de->d_name + strlen(de->d_name) - extension_length, fileExtensionOrDirectory) != 0)
-                    continue;
-            }
-            else
-            {
-                struct stat info;
-                char fullFileName[PATH_MAX];
-                strcpy(fullFileName, directory);
-                strcat(fullFileName, de->d_name);
-                stat(fullFileName, &info);
-                // make sure it is a directory
-                if (!(S_ISDIR(info.st_mode)))
-                    continue;
-            }
+    // skip hidden files
+    if (de->d_name[0] == '.')
+        return DIRSCAN_SKIP;
 
-            if (pass == 0)
-            {
-                total++;
-                continue;
-            }
-
-            files[i] = (char*) malloc(dirLen + strlen(de->d_name) + 2);
-            strcpy(files[i], directory);
-            strcat(files[i], de->d_name);
-            if (fileExtensionOrDirectory == NULL)
-                strcat(files[i], "/");
-            i++;
-        }
-        if (pass == 1)
-            break;
-        if (total == 0)
-            break;
-        rewinddir(dir);
-        *numFiles = total;
-        files = (char**) malloc((total+1)*sizeof(char*));
-        files[total]=NULL;
+    if (extension != NULL)
+    {
+        int extension_length = strlen(extension);
+        // make sure that we can have the desired extension (prevent seg fault)
+        if (name_length >= extension_length &&
+            strcmp(de->d_name + name_length - extension_length, extension) == 0)
+            return DIRSCAN_FILE;
     }
 
-    if(closedir(dir) < 0) {
-        LOGE("Failed to close directory.");
+    int is_dir = de->d_type == DT_DIR;
+    if (de->d_type == DT_UNKNOWN || de->d_type == DT_LNK)
+    {
+        // only stat what readdir couldn't tell us about, or links
+        struct stat info;
+        char fullFileName[PATH_MAX];
+        snprintf(fullFileName, sizeof(fullFileName), "%s%s", path, de->d_name);
+        is_dir = stat(fullFileName, &info) == 0 && S_ISDIR(info.st_mode);
     }
+    if (!is_dir)
+        return DIRSCAN_SKIP;
+    return extension != NULL ? DIRSCAN_DIR : DIRSCAN_FILE;
+}
 
-    if (total==0) {
-        return NULL;
-    }
+// What choose_file_menu() shows: the subdirectories, then the files.
+typedef struct {
+    DirScanList dirs;
+    DirScanList files;
+} FileMenu;
 
-    // sort the result
-    if (files != NULL) {
-        for (i = 0; i < total; i++) {
-            int curMax = -1;
-            int j;
-            for (j = 0; j < total - i; j++) {
-                if (curMax == -1 || strcmp(files[curMax], files[j]) < 0)
-                    curMax = j;
-            }
-            char* temp = files[curMax];
-            files[curMax] = files[total - i - 1];
-            files[total - i - 1] = temp;
-        }
-    }
+static const char* file_menu_item(int index, void* cookie)
+{
+    FileMenu* menu = (FileMenu*) cookie;
+    if (index < menu->dirs.count)
+        return menu->dirs.names[index];
+    return menu->files.names[index - menu->dirs.count];
+}
+
+// Picks up what the scan found since the menu was last started, keeping
+// the highlight on the same entry.  Returns 1 once the scan is done.
+static int update_file_menu(DirScan* scan, FileMenu* menu, int* selection)
+{
+    int total = menu->dirs.count + menu->files.count;
+    const char* selected = *selection < total ? file_menu_item(*selection, menu) : NULL;
+
+    int done = dirscan_collect(scan, &menu->dirs, &menu->files, total == 0);
+    qsort(menu->dirs.names, menu->dirs.count, sizeof(char*), compare_string);
+    qsort(menu->files.names, menu->files.count, sizeof(char*), compare_string);
 
-    return files;
+    total = menu->dirs.count + menu->files.count;
+    *selection = total;     // the back button, if that's where it was
+    if (selected != NULL)
+    {
+        int i;
+        for (i = 0; i < total && file_menu_item(i, menu) != selected; i++)
+            ;
+        *selection = i;
+    }
+    return done;
 }
 
 // pass in NULL for fileExtensionOrDirectory and you will get a directory chooser
 char* choose_file_menu(const char* directory, const char* fileExtensionOrDirectory, const char* headers[])
 {
-    char path[PATH_MAX] = "";
-    DIR *dir;
-    struct dirent *de;
-    int numFiles = 0;
-    int numDirs = 0;
-    int i;
     char* return_value = NULL;
-    int dir_len = strlen(directory);
-
-    char** files = gather_files(directory, fileExtensionOrDirectory, &numFiles);
-    char** dirs = NULL;
-    if (fileExtensionOrDirectory != NULL)
-        dirs = gather_files(directory, NULL, &numDirs);
-    int total = numDirs + numFiles;
-    if (total == 0)
+    FileMenu menu;
+    memset(&menu, 0, sizeof(menu));
+
+    // The menu opens with what has been read so far, and picks up the
+    // rest as the scan finds it; huge folders would take a while otherwise.
+    DirScan* scan = dirscan_start(directory, file_menu_filter, (void*) fileExtensionOrDirectory);
+    if (scan == NULL)
+    {
+        ui_print("无法打开目录.\n");
+        return NULL;
+    }
+
+    int selection = 0;
+    int done = update_file_menu(scan, &menu, &selection);
+    if (menu.dirs.count + menu.files.count == 0)
     {
         ui_print("无法找到所选文件.\n");
     }
     else
     {
-        char** list = (char**) malloc((total + 1) * sizeof(char*));
-        list[total] = NULL;
-
-
-        for (i = 0 ; i < numDirs; i++)
-        {
-            list[i] = strdup(dirs[i] + dir_len);
-        }
-
-        for (i = 0 ; i < numFiles; i++)
-        {
-            list[numDirs + i] = strdup(files[i] + dir_len);
-        }
-
         for (;;)
         {
-            int chosen_item = get_menu_selection(headers, list, 0, 0);
+            if (done && scan != NULL)
+            {
+                dirscan_end(scan);
+                scan = NULL;
+            }
+            if (scan != NULL)
+                dirscan_notify(scan, 1);
+            int chosen_item = get_menu_selection_items(headers, menu.dirs.count + menu.files.count,
+                                                       file_menu_item, &menu, 0, &selection);
+            if (scan != NULL)
+                dirscan_notify(scan, 0);
+
+            if (chosen_item == REFRESH_MENU)
+            {
+                if (scan != NULL)
+                    done = update_file_menu(scan, &menu, &selection);
+                continue;
+            }
             if (chosen_item == GO_BACK)
                 break;
             static char ret[PATH_MAX];
-            if (chosen_item < numDirs)
+            if (chosen_item < menu.dirs.count)
             {
-                char* subret = choose_file_menu(dirs[chosen_item], fileExtensionOrDirectory, headers);
+                char subdir[PATH_MAX];
+                snprintf(subdir, sizeof(subdir), "%s%s", directory, menu.dirs.names[chosen_item]);
+                char* subret = choose_file_menu(subdir, fileExtensionOrDirectory, headers);
                 if (subret != NULL)
                 {
                     strcpy(ret, subret);
@@ -286,15 +269,17 @@ char* choose_file_menu(const char* directory, const char* fileExtensionOrDirecto
                 }
                 continue;
             }
-            strcpy(ret, files[chosen_item - numDirs]);
+            snprintf(ret, sizeof(ret), "%s%s%s", directory, file_menu_item(chosen_item, &menu),
+                     fileExtensionOrDirectory == NULL ? "/" : "");
             return_value = ret;
             break;
         }
-        free_string_array(list);
     }
 
-    free_string_array(files);
-    free_string_array(dirs);
+    if (scan != NULL)
+        dirscan_end(scan);
+    dirscan_free_list(&menu.dirs);
+    dirscan_free_list(&menu.files);
     return return_value;
 }
 
@@ -406,6 +391,25 @@ int confirm_selection(const char* title, const char* confirm)
 #define TUNE2FS_BIN     "/sbin/tune2fs"
 #define E2FSCK_BIN      "/sbin/e2fsck"
 
+/* rm -rf path/* path/.* without forking a shell for it */
+static void remove_directory_contents(const char *path)
+{
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        return;
+
+    struct dirent *de;
+    char tmp[PATH_MAX];
+    while ((de = readdir(dir)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        snprintf(tmp, sizeof(tmp), "%s/%s", path, de->d_name);
+        if (dirUnlinkHierarchy(tmp) != 0)
+            LOGW("Unable to remove %s (%s)\n", tmp, strerror(errno));
+    }
+    closedir(dir);
+}
+
 int format_unknown_device(const char *device, const char* path, const char *fs_type)
 {
     LOGI("Formatting unknown device.\n");
@@ -433,6 +437,8 @@ int format_unknown_device(const char *device, const char* path, const char *fs_t
                 LOGE("Error while unmounting %s.\n", path);
                 return -12;
             }
+            // Discarding first leaves mke2fs nothing stale to work around
+            discard_block_device(device);
             return format_ext3_device(device);
         }
 
@@ -442,6 +448,8 @@ int format_unknown_device(const char *device, const char* path, const char *fs_t
                 LOGE("卸载时出错 %s.\n", path);
                 return -12;
             }
+            // Discarding first leaves mke2fs nothing stale to work around
+            discard_block_device(device);
             return format_ext2_device(device);
         }
     }
@@ -453,11 +461,7 @@ int format_unknown_device(const char *device, const char* path, const char *fs_t
         return 0;
     }
 
-    static char tmp[PATH_MAX];
-    sprintf(tmp, "rm -rf %s/*", path);
-    __system(tmp);
-    sprintf(tmp, "rm -rf %s/.*", path);
-    __system(tmp);
+    remove_directory_contents(path);
 
     ensure_path_unmounted(path);
     return 0;
@@ -853,6 +857,7 @@ void show_advanced_menu()
         switch (chosen_item)
         {
             case 0:
+                ui_flush();
                 __reboot(LINUX_REBOOT_MAGIC1, LINUX_REBOOT_MAGIC2, LINUX_REBOOT_CMD_RESTART2, "recovery");
                 break;
             case 1:
@@ -1052,9 +1057,7 @@ int bml_check_volume(const char *path) {
     }
     
     ui_print("%s may be rfs. Checking...\n", path);
-    char tmp[PATH_MAX];
-    sprintf(tmp, "mount -t rfs %s %s", vol->device, path);
-    int ret = __system(tmp);
+    int ret = try_mount(vol->device, vol->mount_point, "rfs", NULL);
     printf("%d\n", ret);
     return ret == 0 ? 1 : 0;
 }
@@ -1108,7 +1111,7 @@ void handle_failure(int ret)
     if (0 != ensure_path_mounted("/sdcard"))
         return;
     mkdir("/sdcard/clockworkmod", S_IRWXU);
-    __system("cp /tmp/recovery.log /sdcard/clockworkmod/recovery.log");
+    mmc_copy_file("/tmp/recovery.log", "/sdcard/clockworkmod/recovery.log");
     ui_print("/tmp/recovery.log was copied to /sdcard/clockworkmod/recovery.log. Please open ROM Manager to report the issue.\n");
 }
 
@@ -326,6 +326,12 @@ exit:
 
 int
 install_package(const char *path)
+{
+    return install_package_hashed(path, NULL);
+}
+
+int
+install_package_hashed(const char *path, VerifierHash* hash)
 {
     ui_set_background(BACKGROUND_ICON_INSTALLING);
     ui_print("查找刷机包...\n");
@@ -356,7 +362,11 @@ install_package(const char *path)
                 VERIFICATION_PROGRESS_FRACTION,
                 VERIFICATION_PROGRESS_TIME);
 
-        err = verify_file(path, loadedKeys, numKeys);
+        if (hash != NULL) {
+            err = verify_file_hashed(path, hash, loadedKeys, numKeys);
+        } else {
+            err = verify_file(path, loadedKeys, numKeys);
+        }
         free(loadedKeys);
         LOGI("verify_file returned %d\n", err);
         if (err != VERIFY_SUCCESS) {
@@ -18,8 +18,14 @@
 #define RECOVERY_INSTALL_H_
 
 #include "common.h"
+#include "verifier.h"
 
 enum { INSTALL_SUCCESS, INSTALL_ERROR, INSTALL_CORRUPT, INSTALL_UPDATE_SCRIPT_MISSING, INSTALL_UPDATE_BINARY_MISSING };
 int install_package(const char *root_path);
 
+// Like install_package(), but the package's signed data has already
+// been hashed into "hash" (e.g. while copying it), so signature
+// verification only has to read the footer.  "hash" may be NULL.
+int install_package_hashed(const char *root_path, VerifierHash* hash);
+
 #endif  // RECOVERY_INSTALL_H_
@@ -11,10 +11,6 @@ ifneq ($(BOARD_LDPI_RECOVERY),)
     LOCAL_CFLAGS += -DBOARD_LDPI_RECOVERY='"$(BOARD_LDPI_RECOVERY)"'
 endif
 
-ifneq ($(BOARD_HAS_JANKY_BACKBUFFER),)
-    LOCAL_CFLAGS += -DBOARD_HAS_JANKY_BACKBUFFER
-endif
-
 ifeq ($(BOARD_HAS_FLIPPED_SCREEN), true)
     LOCAL_CFLAGS += -DBOARD_HAS_FLIPPED_SCREEN
 endif
@@ -22,3 +18,28 @@ endif
 LOCAL_MODULE := libminui
 
 include $(BUILD_STATIC_LIBRARY)
+
+# Host tool that decodes the recovery's images at build time, so that
+# res_create_surface() can map them rather than run libpng at startup.
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := png2raw.c
+LOCAL_C_INCLUDES += external/libpng external/zlib
+LOCAL_STATIC_LIBRARIES := libpng libz
+LOCAL_LDLIBS += -lm
+LOCAL_MODULE := png2raw
+
+include $(BUILD_HOST_EXECUTABLE)
+
+minui_png2raw := $(LOCAL_BUILT_MODULE)
+minui_images_dir := $(LOCAL_PATH)/../res/images
+minui_raw_images := $(patsubst $(minui_images_dir)/%.png,$(TARGET_RECOVERY_ROOT_OUT)/res/images/%.raw, \
+    $(wildcard $(minui_images_dir)/*.png))
+
+$(minui_raw_images): PNG2RAW := $(minui_png2raw)
+$(minui_raw_images): $(TARGET_RECOVERY_ROOT_OUT)/res/images/%.raw: $(minui_images_dir)/%.png $(minui_png2raw)
+	@echo "Pre-decode: $@"
+	@mkdir -p $(dir $@)
+	$(hide) $(PNG2RAW) $< $@
+
+ALL_DEFAULT_INSTALLED_MODULES += $(minui_raw_images)
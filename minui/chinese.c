@@ -97,12 +97,21 @@ int ch_test_cjk(const char* s)
     return (ch > 0x80) ? 1 : 0;
 }
 
+/* Decode the character at the start of a NUL-terminated string.  No
+ * length is needed: a NUL is never a continuation byte, so decoding stops
+ * there before reading past the end.
+ */
+static int utf8_char(ucs4_t *pwc, const char* s)
+{
+    return utf8_mbtowc(pwc, (const unsigned char*)s, 6);
+}
+
 int ch_utf8_length(const char* s)
 {
     int res;
     ucs4_t ch;
 
-    res = utf8_mbtowc(&ch, (const unsigned char*)s, strlen(s));
+    res = utf8_char(&ch, s);
     if(res <= 0)
         return 0;
     return res;
@@ -110,42 +119,75 @@ int ch_utf8_length(const char* s)
 
 #include "chinese_custom.h"
 
-int ch_utf8_to_custom(const char* s)
+/* Recently used characters and their custom codes, so that a line of text
+ * costs one perfect hash lookup per distinct character rather than one
+ * per glyph.  Like the rest of minui drawing, callers are serialized by
+ * the ui's update lock.
+ */
+#define GLYPH_CACHE_SIZE 512    // a power of two
+
+static struct {
+    ucs4_t ch;                  // 0 if empty; never an ascii character
+    int value;
+} glyph_cache[GLYPH_CACHE_SIZE];
+
+int ch_utf8_decode(const char* s, int* len)
 {
-    int i, n;
     struct utf8_to_custom* res;
     unsigned char name[8];
+    unsigned h;
+    ucs4_t ch;
+    int i, n;
 
-    n = ch_utf8_length(s);
-    if(n <= 0)
+    n = utf8_char(&ch, s);
+    if(n <= 0) {
+        // show a stray byte as a blank rather than stopping
+        *len = 1;
         return 0;
+    }
+    *len = n;
     if(n == 1)
         return (*s - 32);
+
+    h = (ch * 2654435761u) >> 23 & (GLYPH_CACHE_SIZE - 1);
+    if(glyph_cache[h].ch == ch)
+        return glyph_cache[h].value;
+
     for(i = 0; i < n; i++)
         name[i] = ((unsigned char*)(s))[i];
     name[n] = 0;
     res = in_word_set(name, n);
-    if(res)
-        return res->value;
-    else
-        return 0;
+    glyph_cache[h].ch = ch;
+    glyph_cache[h].value = res ? res->value : 0;
+    return glyph_cache[h].value;
+}
+
+int ch_utf8_to_custom(const char* s)
+{
+    int n;
+
+    return ch_utf8_decode(s, &n);
 }
 
 int str_utf8_length(const char* s)
 {
-    int n, l, off;
+    int n, l;
+    ucs4_t ch;
 
     n = 0;
-    off = 0;
-    while(*(s + off))
+    while(*s)
     {
-        l = ch_utf8_length(s + off);
-        off += l;
-        if(l == 1)
+        l = utf8_char(&ch, s);
+        if(l <= 1)
+        {
+            // ascii, or a stray byte shown as a blank
+            s += 1;
             n += 1;
+        }
         else
         {
             // fix me
+            s += l;
             n += 2;
         }
     }
@@ -8,6 +8,8 @@ int ch_test_cjk(const char* s);
 int ch_utf8_length(const char* s);
 // convert utf-8 to our custom encoding
 int ch_utf8_to_custom(const char* s);
+// same, also storing how many bytes the character took (at least 1)
+int ch_utf8_decode(const char* s, int* len);
 // 2 * wide chars + ascii chars
 int str_utf8_length(const char* s);
 
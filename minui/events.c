@@ -16,9 +16,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <dirent.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
 #include <limits.h>
 
 #include <linux/input.h>
@@ -28,6 +33,16 @@
 #include "minui.h"
 
 #define MAX_DEVICES 16
+#define INPUT_DIR "/dev/input"
+
+/* Most events read from a device at once */
+#define EV_BATCH 64
+
+/* epoll tag of the /dev/input watch; devices are tagged with their slot */
+#define EV_HOTPLUG MAX_DEVICES
+
+/* tag of an ev_ready entry whose device has gone away */
+#define EV_GONE (MAX_DEVICES + 1)
 
 #define VIBRATOR_TIMEOUT_FILE	"/sys/class/timed_output/vibrator/enable"
 #define VIBRATOR_TIME_MS	50
@@ -52,7 +67,7 @@ struct position {
 };
 
 struct ev {
-    struct pollfd *fd;
+    int fd;                 /* -1 if the slot is free */
 
     struct virtualkey *vks;
     int vk_count;
@@ -61,9 +76,19 @@ struct ev {
     int sent, mt_idx;
 };
 
-static struct pollfd ev_fds[MAX_DEVICES];
 static struct ev evs[MAX_DEVICES];
-static unsigned ev_count = 0;
+static unsigned ev_count = 0;       /* slots ever used */
+static int ev_epoll_fd = -1;
+static int ev_inotify_fd = -1;
+
+/* Devices epoll reported readable that we haven't read yet */
+static struct epoll_event ev_ready[MAX_DEVICES + 1];
+static int ev_ready_count, ev_ready_pos;
+
+/* The last batch read from one device, handed out one at a time */
+static struct input_event ev_queue[EV_BATCH];
+static int ev_queue_len, ev_queue_pos;
+static struct ev *ev_queue_dev;
 
 static inline int ABS(int x) {
     return x<0?-x:x;
@@ -112,7 +137,7 @@ static int vk_init(struct ev *e)
     e->vk_count = 0;
 
     len = strlen(vk_path);
-    len = ioctl(e->fd->fd, EVIOCGNAME(sizeof(vk_path) - len), vk_path + len);
+    len = ioctl(e->fd, EVIOCGNAME(sizeof(vk_path) - len), vk_path + len);
     if (len <= 0)
         return -1;
 
@@ -145,12 +170,12 @@ static int vk_init(struct ev *e)
     e->sent = 0;
     e->mt_idx = 0;
 
-    ioctl(e->fd->fd, EVIOCGABS(ABS_X), &e->p.xi);
-    ioctl(e->fd->fd, EVIOCGABS(ABS_Y), &e->p.yi);
+    ioctl(e->fd, EVIOCGABS(ABS_X), &e->p.xi);
+    ioctl(e->fd, EVIOCGABS(ABS_Y), &e->p.yi);
     e->p.pressed = 0;
 
-    ioctl(e->fd->fd, EVIOCGABS(ABS_MT_POSITION_X), &e->mt_p.xi);
-    ioctl(e->fd->fd, EVIOCGABS(ABS_MT_POSITION_Y), &e->mt_p.yi);
+    ioctl(e->fd, EVIOCGABS(ABS_MT_POSITION_X), &e->mt_p.xi);
+    ioctl(e->fd, EVIOCGABS(ABS_MT_POSITION_Y), &e->mt_p.yi);
     e->mt_p.pressed = 0;
 
     e->vks = malloc(sizeof(*e->vks) * e->vk_count);
@@ -179,30 +204,126 @@ static int vk_init(struct ev *e)
     return 0;
 }
 
+/* True if a device node is already open in some slot */
+static int ev_is_open(dev_t rdev)
+{
+    struct stat st;
+    unsigned n;
+
+    for(n = 0; n < ev_count; n++) {
+        if(evs[n].fd >= 0 && fstat(evs[n].fd, &st) == 0 && st.st_rdev == rdev)
+            return 1;
+    }
+    return 0;
+}
+
+static void ev_add_device(const char *name)
+{
+    char path[PATH_MAX];
+    struct epoll_event ee;
+    struct stat st;
+    unsigned n;
+    int fd;
+
+    if(strncmp(name, "event", 5)) return;
+    for(n = 0; n < ev_count && evs[n].fd >= 0; n++)
+        ;
+    if(n == MAX_DEVICES) return;
+
+    /* a node created while ev_init() scans is both read from the
+     * directory and reported by inotify; open it only once */
+    snprintf(path, sizeof(path), INPUT_DIR "/%s", name);
+    if(stat(path, &st) == 0 && ev_is_open(st.st_rdev)) return;
+    fd = open(path, O_RDONLY | O_NONBLOCK);
+    if(fd < 0) return;
+
+    memset(&evs[n], 0, sizeof(evs[n]));
+    evs[n].fd = fd;
+
+    /* Load virtualkeys if there are any */
+    vk_init(&evs[n]);
+
+    ee.events = EPOLLIN;
+    ee.data.u32 = n;
+    if(epoll_ctl(ev_epoll_fd, EPOLL_CTL_ADD, fd, &ee) < 0) {
+        LOGW("minui: can't watch %s (%s)\n", path, strerror(errno));
+        if (evs[n].vk_count) free(evs[n].vks);
+        close(fd);
+        evs[n].fd = -1;
+        return;
+    }
+    if(n == ev_count) ev_count++;
+}
+
+static void ev_remove_device(struct ev *e)
+{
+    int i;
+
+    /* the slot may be reused before the rest of this epoll batch is
+     * handled; don't let those entries read from the new device */
+    for(i = ev_ready_pos; i < ev_ready_count; i++) {
+        if(ev_ready[i].data.u32 == (unsigned) (e - evs))
+            ev_ready[i].data.u32 = EV_GONE;
+    }
+
+    epoll_ctl(ev_epoll_fd, EPOLL_CTL_DEL, e->fd, NULL);
+    close(e->fd);
+    e->fd = -1;
+    if (e->vk_count) {
+        free(e->vks);
+        e->vk_count = 0;
+    }
+    if (ev_queue_dev == e) ev_queue_len = ev_queue_pos = 0;
+}
+
+/* Picks up devices created in /dev/input since ev_init() */
+static void ev_hotplug(void)
+{
+    char buf[512] __attribute__((aligned(4)));
+    struct inotify_event *ie;
+    ssize_t r;
+    char *p;
+
+    r = read(ev_inotify_fd, buf, sizeof(buf));
+    for(p = buf; r > 0 && p < buf + r; p += sizeof(*ie) + ie->len) {
+        ie = (struct inotify_event *) p;
+        if((ie->mask & IN_CREATE) && ie->len > 0)
+            ev_add_device(ie->name);
+    }
+}
+
 int ev_init(void)
 {
     DIR *dir;
     struct dirent *de;
-    int fd;
+    struct epoll_event ee;
+
+    ev_epoll_fd = epoll_create(MAX_DEVICES + 1);
+    if(ev_epoll_fd < 0) {
+        LOGE("minui: epoll_create failed (%s)\n", strerror(errno));
+        return -1;
+    }
 
-    dir = opendir("/dev/input");
+    /* watch before scanning, so that nothing slips in between */
+    ee.events = EPOLLIN;
+    ee.data.u32 = EV_HOTPLUG;
+    ev_inotify_fd = inotify_init();
+    if(ev_inotify_fd < 0 ||
+       inotify_add_watch(ev_inotify_fd, INPUT_DIR, IN_CREATE) < 0 ||
+       epoll_ctl(ev_epoll_fd, EPOLL_CTL_ADD, ev_inotify_fd, &ee) < 0) {
+        LOGW("minui: can't watch " INPUT_DIR " (%s); no input hotplug\n",
+             strerror(errno));
+        if(ev_inotify_fd >= 0) close(ev_inotify_fd);
+        ev_inotify_fd = -1;
+    }
+
+    dir = opendir(INPUT_DIR);
     if(dir != 0) {
         while((de = readdir(dir))) {
 //            fprintf(stderr,"/dev/input/%s\n", de->d_name);
-            if(strncmp(de->d_name,"event",5)) continue;
-            fd = openat(dirfd(dir), de->d_name, O_RDONLY);
-            if(fd < 0) continue;
-
-            ev_fds[ev_count].fd = fd;
-            ev_fds[ev_count].events = POLLIN;
-            evs[ev_count].fd = &ev_fds[ev_count];
-
-            /* Load virtualkeys if there are any */
-            vk_init(&evs[ev_count]);
-
-            ev_count++;
-            if(ev_count == MAX_DEVICES) break;
+            ev_add_device(de->d_name);
         }
+        closedir(dir);
     }
 
     return 0;
@@ -211,12 +332,14 @@ int ev_init(void)
 void ev_exit(void)
 {
     while (ev_count-- > 0) {
-	if (evs[ev_count].vk_count) {
-		free(evs[ev_count].vks);
-		evs[ev_count].vk_count = 0;
-	}
-        close(ev_fds[ev_count].fd);
+        if (evs[ev_count].fd >= 0)
+            ev_remove_device(&evs[ev_count]);
     }
+    ev_count = 0;
+    if (ev_inotify_fd >= 0) close(ev_inotify_fd);
+    ev_inotify_fd = -1;
+    close(ev_epoll_fd);
+    ev_epoll_fd = -1;
 }
 
 static int vk_inside_display(__s32 value, struct input_absinfo *info, int screen_size)
@@ -339,26 +462,56 @@ static int vk_modify(struct ev *e, struct input_event *ev)
     return 1;
 }
 
+/* Reads whatever a ready device has, up to a batch */
+static void ev_read(const struct epoll_event *ee)
+{
+    struct ev *e;
+    ssize_t r;
+
+    if(ee->data.u32 == EV_HOTPLUG) {
+        ev_hotplug();
+        return;
+    }
+
+    if(ee->data.u32 == EV_GONE) return;
+
+    e = &evs[ee->data.u32];
+    if(e->fd < 0) return;
+
+    r = read(e->fd, ev_queue, sizeof(ev_queue));
+    if(r < 0) {
+        if(errno == ENODEV) ev_remove_device(e);    /* unplugged */
+        return;
+    }
+    ev_queue_len = r / sizeof(ev_queue[0]);
+    ev_queue_pos = 0;
+    ev_queue_dev = e;
+}
+
 int ev_get(struct input_event *ev, unsigned dont_wait)
 {
     int r;
-    unsigned n;
 
-    do {
-        r = poll(ev_fds, ev_count, dont_wait ? 0 : -1);
+    for(;;) {
+        /* finish the batch we have, then go on to the next ready device,
+         * so that a flood from one can't starve the others */
+        while(ev_queue_pos < ev_queue_len) {
+            *ev = ev_queue[ev_queue_pos++];
+            if (!vk_modify(ev_queue_dev, ev))
+                return 0;
+        }
+        if(ev_ready_pos < ev_ready_count) {
+            ev_read(&ev_ready[ev_ready_pos++]);
+            continue;
+        }
 
+        r = epoll_wait(ev_epoll_fd, ev_ready, MAX_DEVICES + 1,
+                       dont_wait ? 0 : -1);
         if(r > 0) {
-            for(n = 0; n < ev_count; n++) {
-                if(ev_fds[n].revents & POLLIN) {
-                    r = read(ev_fds[n].fd, ev, sizeof(*ev));
-                    if(r == sizeof(*ev)) {
-                        if (!vk_modify(&evs[n], ev))
-                            return 0;
-                    }
-                }
-            }
+            ev_ready_count = r;
+            ev_ready_pos = 0;
+        } else if(dont_wait) {
+            return -1;
         }
-    } while(dont_wait == 0);
-
-    return -1;
+    }
 }
@@ -15,6 +15,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <fcntl.h>
@@ -50,6 +51,27 @@ static unsigned gr_active_fb = 0;
 static int gr_fb_fd = -1;
 static int gr_vt_fd = -1;
 
+/* Whether the framebuffer has room for two pages we can pan between, and
+ * whether we can draw straight into the hidden one rather than into
+ * gr_mem_surface.  Set up by get_framebuffer().
+ */
+static int gr_double_buffered = 0;
+static int gr_direct = 0;
+static int gr_pan_works = 1;
+static GGLSurface *gr_draw = 0;
+
+/* Pixel layout of the panel, which the memory surface shares so that
+ * flips are plain copies.
+ */
+static int gr_pixel_format = GGL_PIXEL_FORMAT_RGB_565;
+static int gr_bytes_per_pixel = 2;
+
+/* Area (x0, y0, x1, y1) changed by the previous flip.  The buffer we're
+ * about to draw into last showed the frame before that, so it's missing
+ * those pixels as well as whatever changes now.
+ */
+static int gr_prev_damage[4];
+
 static struct fb_var_screeninfo vi;
 
 static int get_framebuffer(GGLSurface *fb)
@@ -64,18 +86,42 @@ static int get_framebuffer(GGLSurface *fb)
         return -1;
     }
 
-    if (ioctl(fd, FBIOGET_FSCREENINFO, &fi) < 0) {
+    if (ioctl(fd, FBIOGET_VSCREENINFO, &vi) < 0) {
         perror("failed to get fb0 info");
         close(fd);
         return -1;
     }
 
-    if (ioctl(fd, FBIOGET_VSCREENINFO, &vi) < 0) {
+    /* ask for two pages once, so that flipping is just a pan */
+    vi.yres_virtual = vi.yres * 2;
+    vi.yoffset = 0;
+    if (vi.bits_per_pixel != 16 && vi.bits_per_pixel != 32) {
+        vi.bits_per_pixel = 16;
+    }
+    if (ioctl(fd, FBIOPUT_VSCREENINFO, &vi) < 0) {
+        perror("failed to set fb0 to two pages");
+    }
+
+    if (ioctl(fd, FBIOGET_FSCREENINFO, &fi) < 0 ||
+        ioctl(fd, FBIOGET_VSCREENINFO, &vi) < 0) {
         perror("failed to get fb0 info");
         close(fd);
         return -1;
     }
 
+    if (vi.bits_per_pixel == 16) {
+        gr_pixel_format = GGL_PIXEL_FORMAT_RGB_565;
+    } else if (vi.bits_per_pixel == 32) {
+        gr_pixel_format = (vi.red.offset == 16) ?
+                GGL_PIXEL_FORMAT_BGRA_8888 : GGL_PIXEL_FORMAT_RGBX_8888;
+    } else {
+        fprintf(stderr, "unsupported framebuffer depth %d\n",
+                vi.bits_per_pixel);
+        close(fd);
+        return -1;
+    }
+    gr_bytes_per_pixel = vi.bits_per_pixel / 8;
+
     bits = mmap(0, fi.smem_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     if (bits == MAP_FAILED) {
         perror("failed to mmap framebuffer");
@@ -83,32 +129,43 @@ static int get_framebuffer(GGLSurface *fb)
         return -1;
     }
 
+    /* rows may be padded; trust line_length unless it's nonsense */
+    unsigned stride = fi.line_length / gr_bytes_per_pixel;
+    if (stride < vi.xres) stride = vi.xres;
+    unsigned page_size = vi.yres * stride * gr_bytes_per_pixel;
+
     fb->version = sizeof(*fb);
     fb->width = vi.xres;
     fb->height = vi.yres;
-#ifdef BOARD_HAS_JANKY_BACKBUFFER
-    fb->stride = fi.line_length/2;
-#else
-    fb->stride = vi.xres;
-#endif
+    fb->stride = stride;
     fb->data = bits;
-    fb->format = GGL_PIXEL_FORMAT_RGB_565;
-    memset(fb->data, 0, vi.yres * vi.xres * 2);
+    fb->format = gr_pixel_format;
+    memset(fb->data, 0, page_size);
+
+    gr_double_buffered = vi.yres_virtual >= vi.yres * 2 &&
+            fi.smem_len >= page_size * 2;
 
     fb++;
 
+    if (!gr_double_buffered) {
+        /* draw and show the one page there is */
+        fprintf(stderr, "framebuffer: single buffered\n");
+        *fb = *(fb - 1);
+        return fd;
+    }
+
     fb->version = sizeof(*fb);
     fb->width = vi.xres;
     fb->height = vi.yres;
-#ifdef BOARD_HAS_JANKY_BACKBUFFER
-    fb->stride = fi.line_length/2;
-    fb->data = (void*) (((unsigned) bits) + vi.yres * fi.line_length);
-#else
-    fb->stride = vi.xres;
-    fb->data = (void*) (((unsigned) bits) + vi.yres * vi.xres * 2);
+    fb->stride = stride;
+    fb->data = (GGLubyte *) bits + page_size;
+    fb->format = gr_pixel_format;
+    memset(fb->data, 0, page_size);
+
+#ifndef BOARD_HAS_FLIPPED_SCREEN
+    /* the screen shows pixels as drawn, so draw into the hidden page */
+    gr_direct = stride == vi.xres;
 #endif
-    fb->format = GGL_PIXEL_FORMAT_RGB_565;
-    memset(fb->data, 0, vi.yres * vi.xres * 2);
 
     return fd;
 }
@@ -118,47 +175,170 @@ static void get_memory_surface(GGLSurface* ms) {
   ms->width = vi.xres;
   ms->height = vi.yres;
   ms->stride = vi.xres;
-  ms->data = malloc(vi.xres * vi.yres * 2);
-  ms->format = GGL_PIXEL_FORMAT_RGB_565;
+  ms->data = malloc(vi.xres * vi.yres * gr_bytes_per_pixel);
+  ms->format = gr_pixel_format;
 }
 
 static void set_active_framebuffer(unsigned n)
 {
-    if (n > 1) return;
-    vi.yres_virtual = vi.yres * 2;
+    if (n > 1 || !gr_double_buffered) return;
     vi.yoffset = n * vi.yres;
-    vi.bits_per_pixel = 16;
+    if (gr_pan_works) {
+        if (ioctl(gr_fb_fd, FBIOPAN_DISPLAY, &vi) == 0) return;
+        /* some drivers only move the visible page on a full mode set */
+        perror("fb pan failed, falling back to mode set");
+        gr_pan_works = 0;
+    }
     if (ioctl(gr_fb_fd, FBIOPUT_VSCREENINFO, &vi) < 0) {
         perror("active fb swap failed");
     }
 }
 
-void gr_flip(void)
+/* Copy the rectangle [x0,x1) x [y0,y1) of one surface to another, a row
+ * at a time since the strides may differ.
+ */
+static void copy_rect(GGLSurface *dst, GGLSurface *src,
+                      int x0, int y0, int x1, int y1)
 {
-    GGLContext *gl = gr_context;
+    const int bpp = gr_bytes_per_pixel;
+    int y;
+    for (y = y0; y < y1; ++y) {
+        memcpy(dst->data + (y * dst->stride + x0) * bpp,
+               src->data + (y * src->stride + x0) * bpp,
+               (x1 - x0) * bpp);
+    }
+}
 
-    /* swap front and back buffers */
-    gr_active_fb = (gr_active_fb + 1) & 1;
+#ifdef BOARD_HAS_FLIPPED_SCREEN
+/* Copy n 16-bit pixels from src to dst, writing dst backwards from the
+ * given (last) pixel.  Moves two pixels per word when dst and src line up.
+ */
+static void copy_row_reversed16(unsigned short *dst, const unsigned short *src,
+                              int n)
+{
+    if (n > 0 && ((unsigned long) src & 2)) {
+        *dst-- = *src++;
+        --n;
+    }
+    if (((unsigned long) (dst - 1) & 3) == 0) {
+        const unsigned int *s = (const unsigned int *) src;
+        unsigned int *d = (unsigned int *) (dst - 1);
+        for (; n >= 2; n -= 2) {
+            unsigned int w = *s++;
+            *d-- = (w << 16) | (w >> 16);
+        }
+        src = (const unsigned short *) s;
+        dst = (unsigned short *) d + 1;
+    }
+    while (n-- > 0) {
+        *dst-- = *src++;
+    }
+}
 
+/* The same for 32-bit pixels, which are already a word each. */
+static void copy_row_reversed32(unsigned int *dst, const unsigned int *src,
+                                int n)
+{
+    while (n-- > 0) {
+        *dst-- = *src++;
+    }
+}
+#endif
+
+/* Copy the rectangle [x0,x1) x [y0,y1) of the memory surface into the
+ * framebuffer.
+ */
+static void copy_to_framebuffer(GGLSurface *fb, int x0, int y0, int x1, int y1)
+{
 #ifdef BOARD_HAS_FLIPPED_SCREEN
-    /* flip buffer 180 degrees for devices with physicaly inverted screens */
-    unsigned int i;
-    for (i = 1; i < (vi.xres * vi.yres); i++) {
-        unsigned short tmp = gr_mem_surface.data[i];
-        gr_mem_surface.data[i] = gr_mem_surface.data[(vi.xres * vi.yres * 2) - i];
-        gr_mem_surface.data[(vi.xres * vi.yres * 2) - i] = tmp;
+    /* rotate 180 degrees for devices with physically inverted screens,
+     * leaving the memory surface as drawn */
+    const int bpp = gr_bytes_per_pixel;
+    int y;
+    for (y = y0; y < y1; ++y) {
+        const GGLubyte *src = gr_mem_surface.data +
+                (y * gr_mem_surface.stride + x0) * bpp;
+        GGLubyte *dst = fb->data +
+                ((vi.yres - 1 - y) * fb->stride + (vi.xres - 1 - x0)) * bpp;
+        if (bpp == 4) {
+            copy_row_reversed32((unsigned int *) dst,
+                                (const unsigned int *) src, x1 - x0);
+        } else {
+            copy_row_reversed16((unsigned short *) dst,
+                                (const unsigned short *) src, x1 - x0);
+        }
     }
+#else
+    copy_rect(fb, &gr_mem_surface, x0, y0, x1, y1);
 #endif
+}
+
+void gr_flip_region(int x, int y, int w, int h)
+{
+    GGLContext *gl = gr_context;
+    int x0 = x, y0 = y, x1 = x + w, y1 = y + h;
+
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > (int) vi.xres) x1 = vi.xres;
+    if (y1 > (int) vi.yres) y1 = vi.yres;
+    if (x0 >= x1 || y0 >= y1) return;
+
+    if (gr_direct) {
+        /* show the page we drew into, then bring the other one up to
+         * date so the next frame can again draw just what changes. */
+        gr_active_fb = (gr_active_fb + 1) & 1;
+        set_active_framebuffer(gr_active_fb);
+        gr_draw = &gr_framebuffer[(gr_active_fb + 1) & 1];
+        copy_rect(gr_draw, &gr_framebuffer[gr_active_fb], x0, y0, x1, y1);
+        gl->colorBuffer(gl, gr_draw);
+        return;
+    }
+
+    if (!gr_double_buffered) {
+        /* nothing to flip; update the visible page in place */
+        copy_to_framebuffer(&gr_framebuffer[0], x0, y0, x1, y1);
+        return;
+    }
+
+    /* swap front and back buffers */
+    gr_active_fb = (gr_active_fb + 1) & 1;
+
+    /* copy what changed in this frame or the last one from the in-memory
+     * surface to the buffer we're about to make active. */
+    int cx0 = x0 < gr_prev_damage[0] ? x0 : gr_prev_damage[0];
+    int cy0 = y0 < gr_prev_damage[1] ? y0 : gr_prev_damage[1];
+    int cx1 = x1 > gr_prev_damage[2] ? x1 : gr_prev_damage[2];
+    int cy1 = y1 > gr_prev_damage[3] ? y1 : gr_prev_damage[3];
+    copy_to_framebuffer(&gr_framebuffer[gr_active_fb], cx0, cy0, cx1, cy1);
 
-    /* copy data from the in-memory surface to the buffer we're about
-     * to make active. */
-    memcpy(gr_framebuffer[gr_active_fb].data, gr_mem_surface.data,
-           vi.xres * vi.yres * 2);
+    gr_prev_damage[0] = x0;
+    gr_prev_damage[1] = y0;
+    gr_prev_damage[2] = x1;
+    gr_prev_damage[3] = y1;
 
     /* inform the display driver */
     set_active_framebuffer(gr_active_fb);
 }
 
+void gr_flip(void)
+{
+    gr_flip_region(0, 0, vi.xres, vi.yres);
+}
+
+void gr_set_clip(int x, int y, int w, int h)
+{
+    GGLContext *gl = gr_context;
+    gl->scissor(gl, x, y, w, h);
+    gl->enable(gl, GGL_SCISSOR_TEST);
+}
+
+void gr_clear_clip(void)
+{
+    GGLContext *gl = gr_context;
+    gl->disable(gl, GGL_SCISSOR_TEST);
+}
+
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a)
 {
     GGLContext *gl = gr_context;
@@ -175,18 +355,59 @@ int gr_measure(const char *s)
     return gr_font->cwidth * str_utf8_length(s);
 }
 
-static GGLSurface font_ftex;
 static int font_bitmap_count;
 static int font_char_per_bitmap = 128;
-static void** font_data;
+static void** font_data;        // NULL until the bitmap is first used
+
+/* Where each row of each bitmap starts in font.rundata: which run, and
+ * how many of its pixels belong to the bitmap before.  Lets a bitmap be
+ * decoded on its own, the first time one of its glyphs is drawn.
+ */
+typedef struct {
+    unsigned run;
+    unsigned skip;
+} FontRunPos;
+static FontRunPos *font_row_start;  // font.height entries per bitmap
 
-#include <sys/time.h>
+static void *font_bitmap(int bmp)
+{
+    const unsigned bitmap_width = font_char_per_bitmap * font.cwidth;
+    unsigned char *bits, *out;
+    const unsigned char *in;
+    unsigned row, x, cols, skip, n;
+
+    if (font_data[bmp] != NULL) return font_data[bmp];
+
+    bits = calloc(bitmap_width * font.height, 1);
+    if (bits == NULL) return NULL;
+
+    /* the last bitmap may be narrower than the others */
+    cols = font.width - bmp * bitmap_width;
+    if (cols > bitmap_width) cols = bitmap_width;
+
+    for (row = 0; row < font.height; ++row) {
+        const FontRunPos *pos = &font_row_start[bmp * font.height + row];
+        in = font.rundata + pos->run;
+        skip = pos->skip;
+        out = bits + row * bitmap_width;
+        for (x = 0; x < cols && *in; ++in, skip = 0) {
+            n = (*in & 0x7f) - skip;
+            if (n > cols - x) n = cols - x;
+            if (*in & 0x80) memset(out + x, 0xff, n);
+            x += n;
+        }
+    }
+
+    font_data[bmp] = bits;
+    return bits;
+}
 
 int gr_text(int x, int y, const char *s)
 {
     GGLContext *gl = gr_context;
     GRFont *gfont = gr_font;
-    unsigned off, width, height, font_bitmap_width, n;
+    unsigned off, col, width;
+    int n, bmp, bound = -1;
 
     y -= gfont->ascent;
 
@@ -195,34 +416,36 @@ int gr_text(int x, int y, const char *s)
     gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
     gl->enable(gl, GGL_TEXTURE_2D);
 
-    while((off = *s)) {
+    while(*s) {
         if(*((unsigned char*)(s)) < 0x20) {
             s++;
             continue;
         }
-        width = gfont->cwidth;
-        height = gfont->cheight;
-        off = ch_utf8_to_custom(s);
-        if(off >= 96)
-            width *= 2;
-        memcpy(&font_ftex, &gfont->texture, sizeof(font_ftex));
-        font_bitmap_width = (font.width % (font.cwidth * font_char_per_bitmap));
-        if(!font_bitmap_width)
-            font_bitmap_width = font.cwidth * font_char_per_bitmap;
-        font_ftex.width = font_bitmap_width;
-        font_ftex.stride = font_bitmap_width;
-        font_ftex.data = font_data[(off < 96) ? (off / font_char_per_bitmap) : ((96 + (off - 96) * 2) / font_char_per_bitmap)];
-        gl->bindTexture(gl, &font_ftex);
-        if(off >= 96)
-            gl->texCoord2i(gl, ((96 + (off - 96) * 2) * font.cwidth) % (font_char_per_bitmap * font.cwidth) - x, 0 - y);
-        else
-            gl->texCoord2i(gl, (off % font_char_per_bitmap) * width - x, 0 - y);
-        gl->recti(gl, x, y, x + width, y + height);
-        x += width;
-        n = ch_utf8_length(s);
-        if(n <= 0)
-            break;
+        off = ch_utf8_decode(s, &n);
         s += n;
+        // 96 narrow glyphs, then the double width ones
+        if(off < 96) {
+            col = off;
+            width = gfont->cwidth;
+        } else {
+            col = 96 + (off - 96) * 2;
+            width = gfont->cwidth * 2;
+        }
+        // runs of glyphs from the same bitmap share one bind
+        bmp = col / font_char_per_bitmap;
+        if(bmp != bound) {
+            gfont->texture.data = font_bitmap(bmp);
+            if(gfont->texture.data)
+                gl->bindTexture(gl, &gfont->texture);
+            bound = bmp;
+        }
+        if(!gfont->texture.data) {
+            x += width;
+            continue;
+        }
+        gl->texCoord2i(gl, (col % font_char_per_bitmap) * font.cwidth - x, 0 - y);
+        gl->recti(gl, x, y, x + width, y + gfont->cheight);
+        x += width;
     }
 
     return x;
@@ -266,40 +489,48 @@ unsigned int gr_get_height(gr_surface surface) {
 
 static void gr_init_font(void)
 {
+    const unsigned bitmap_width = font_char_per_bitmap * font.cwidth;
     GGLSurface *ftex;
-    unsigned char *bits, *rle;
-    unsigned char *in, data;
-    int i, d, n, bmp, pos;
+    unsigned char *in;
+    unsigned d, n, next, run;
 
     gr_font = calloc(sizeof(*gr_font), 1);
     ftex = &gr_font->texture;
 
-    font_bitmap_count = font.width / font.cwidth / font_char_per_bitmap + 1;
-    font_data = (void**)malloc(font_bitmap_count * sizeof(void*));
-    for(n = 0; n < font_bitmap_count; n++)
+    font_bitmap_count = (font.width + bitmap_width - 1) / bitmap_width;
+    font_data = calloc(font_bitmap_count, sizeof(void*));
+    font_row_start = calloc(font_bitmap_count * font.height,
+                            sizeof(*font_row_start));
+
+    /* Decoding everything up front would take a few MB for the CJK font,
+     * most of which is never shown.  Just note where each bitmap's rows
+     * start; font_bitmap() does the rest on demand. */
+    d = 0;          // pixel at the start of the current run
+    next = 0;       // next pixel that starts a row of some bitmap
+    for(in = font.rundata; *in; in++)     // same end as font_bitmap()
     {
-        font_data[n] = malloc(font_char_per_bitmap * font.cwidth * font.cheight);
-        memset(font_data[n], 0, font_char_per_bitmap * font.cwidth * font.cheight);
-    }
-    d = 0;
-    in = font.rundata;
-    while((data = *in++))
-    {
-        n = data & 0x7f;
-        for(i = 0; i < n; i++, d++)
+        n = *in & 0x7f;
+        run = in - font.rundata;
+        while(next < d + n)
         {
-            bmp = d % font.width / (font.cwidth * font_char_per_bitmap);
-            pos = d / font.width * (font.cwidth * font_char_per_bitmap) + (d % (font.cwidth * font_char_per_bitmap));
-            ((unsigned char*)(font_data[bmp]))[pos] = (data & 0x80) ? 0xff : 0;
+            unsigned row = next / font.width;
+            unsigned bmp = next % font.width / bitmap_width;
+            font_row_start[bmp * font.height + row].run = run;
+            font_row_start[bmp * font.height + row].skip = next - d;
+            if(next % font.width + bitmap_width < font.width)
+                next += bitmap_width;
+            else
+                next = (row + 1) * font.width;
         }
+        d += n;
     }
-    bits = font_data[0];
 
+    /* one bitmap at a time is bound as the texture */
     ftex->version = sizeof(*ftex);
-    ftex->width = font.width;
+    ftex->width = font_char_per_bitmap * font.cwidth;
     ftex->height = font.height;
-    ftex->stride = font.width;
-    ftex->data = (void*) bits;
+    ftex->stride = font_char_per_bitmap * font.cwidth;
+    ftex->data = NULL;
     ftex->format = GGL_PIXEL_FORMAT_A_8;
 
     gr_font->cwidth = font.cwidth;
@@ -330,15 +561,25 @@ int gr_init(void)
         return -1;
     }
 
-    get_memory_surface(&gr_mem_surface);
+    if (gr_direct) {
+        gr_draw = &gr_framebuffer[1];
+    } else {
+        get_memory_surface(&gr_mem_surface);
+        gr_draw = &gr_mem_surface;
+    }
+    // neither framebuffer holds anything we drew yet
+    gr_prev_damage[0] = gr_prev_damage[1] = 0;
+    gr_prev_damage[2] = vi.xres;
+    gr_prev_damage[3] = vi.yres;
 
-    fprintf(stderr, "framebuffer: fd %d (%d x %d)\n",
-            gr_fb_fd, gr_framebuffer[0].width, gr_framebuffer[0].height);
+    fprintf(stderr, "framebuffer: fd %d (%d x %d)%s\n",
+            gr_fb_fd, gr_framebuffer[0].width, gr_framebuffer[0].height,
+            gr_direct ? ", direct" : "");
 
         /* start with 0 as front (displayed) and 1 as back (drawing) */
     gr_active_fb = 0;
     set_active_framebuffer(0);
-    gl->colorBuffer(gl, &gr_mem_surface);
+    gl->colorBuffer(gl, gr_draw);
 
     gl->activeTexture(gl, 0);
     gl->enable(gl, GGL_BLEND);
@@ -369,7 +610,12 @@ int gr_fb_height(void)
     return gr_framebuffer[0].height;
 }
 
+int gr_fb_bpp(void)
+{
+    return gr_bytes_per_pixel * 8;
+}
+
 gr_pixel *gr_fb_data(void)
 {
-    return (unsigned short *) gr_mem_surface.data;
+    return (unsigned short *) gr_draw->data;
 }
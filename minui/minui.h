@@ -25,8 +25,16 @@ void gr_exit(void);
 
 int gr_fb_width(void);
 int gr_fb_height(void);
+// Bits per pixel of the panel, and of the pixels gr_fb_data() points at.
+int gr_fb_bpp(void);
 gr_pixel *gr_fb_data(void);
 void gr_flip(void);
+// Like gr_flip(), when only the given rectangle changed since the last flip.
+void gr_flip_region(int x, int y, int w, int h);
+
+// Limit drawing to a rectangle, e.g. to repaint just the damaged part.
+void gr_set_clip(int x, int y, int w, int h);
+void gr_clear_clip(void);
 
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a);
 void gr_fill(int x, int y, int w, int h);
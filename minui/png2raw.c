@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host tool: png2raw <in.png> <out.raw>
+// Decodes a recovery image into the form res_create_surface() maps.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <png.h>
+
+#include "raw_image.h"
+
+int main(int argc, char **argv)
+{
+    png_structp png_ptr = NULL;
+    png_infop info_ptr = NULL;
+    unsigned char header[8];
+    unsigned char *pixels = NULL;
+    FILE *in = NULL, *out = NULL;
+    int result = 1;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <in.png> <out.raw>\n", argv[0]);
+        return 2;
+    }
+
+    in = fopen(argv[1], "rb");
+    if (in == NULL) {
+        perror(argv[1]);
+        goto exit;
+    }
+    if (fread(header, 1, sizeof(header), in) != sizeof(header) ||
+        png_sig_cmp(header, 0, sizeof(header))) {
+        fprintf(stderr, "%s: not a png\n", argv[1]);
+        goto exit;
+    }
+
+    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (png_ptr == NULL) goto exit;
+    info_ptr = png_create_info_struct(png_ptr);
+    if (info_ptr == NULL) goto exit;
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        fprintf(stderr, "%s: decode failed\n", argv[1]);
+        goto exit;
+    }
+
+    png_init_io(png_ptr, in);
+    png_set_sig_bytes(png_ptr, sizeof(header));
+    png_read_info(png_ptr, info_ptr);
+
+    // Whatever the png holds, end up with 8-bit RGBA.
+    int color_type = png_get_color_type(png_ptr, info_ptr);
+    if (color_type == PNG_COLOR_TYPE_PALETTE) png_set_palette_to_rgb(png_ptr);
+    if (color_type == PNG_COLOR_TYPE_GRAY ||
+        color_type == PNG_COLOR_TYPE_GRAY_ALPHA) png_set_gray_to_rgb(png_ptr);
+    if (png_get_bit_depth(png_ptr, info_ptr) == 16) png_set_strip_16(png_ptr);
+    if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)) {
+        png_set_tRNS_to_alpha(png_ptr);
+    }
+    png_set_filler(png_ptr, 0xff, PNG_FILLER_AFTER);
+    png_read_update_info(png_ptr, info_ptr);
+
+    RawImageHeader raw;
+    raw.magic = RAW_IMAGE_MAGIC;
+    raw.width = png_get_image_width(png_ptr, info_ptr);
+    raw.height = png_get_image_height(png_ptr, info_ptr);
+    raw.channels = 3;
+
+    size_t stride = raw.width * 4;
+    pixels = malloc(stride * raw.height);
+    if (pixels == NULL) {
+        fprintf(stderr, "%s: out of memory\n", argv[1]);
+        goto exit;
+    }
+    unsigned int y;
+    for (y = 0; y < raw.height; ++y) {
+        png_read_row(png_ptr, pixels + y * stride, NULL);
+    }
+
+    size_t i;
+    for (i = 3; i < stride * raw.height; i += 4) {
+        if (pixels[i] != 0xff) {
+            raw.channels = 4;
+            break;
+        }
+    }
+
+    out = fopen(argv[2], "wb");
+    if (out == NULL) {
+        perror(argv[2]);
+        goto exit;
+    }
+    int ok = fwrite(&raw, sizeof(raw), 1, out) == 1 &&
+             fwrite(pixels, stride, raw.height, out) == raw.height;
+    if (fclose(out) != 0) ok = 0;
+    out = NULL;
+    if (!ok) {
+        perror(argv[2]);
+        remove(argv[2]);
+        goto exit;
+    }
+    result = 0;
+
+exit:
+    if (png_ptr != NULL) png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    if (in != NULL) fclose(in);
+    if (out != NULL) fclose(out);
+    free(pixels);
+    return result;
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RAW_IMAGE_H_
+#define _RAW_IMAGE_H_
+
+// Images under /res/images decoded at build time by png2raw, so that
+// res_create_surface() can map them instead of running libpng.  The
+// header is followed by width * height 4-byte RGBA pixels, rows packed,
+// in the target's (little endian) byte order.
+
+#define RAW_IMAGE_MAGIC 0x474d4952  // "RIMG"
+
+typedef struct {
+    unsigned int magic;
+    unsigned int width;
+    unsigned int height;
+    unsigned int channels;  // 3 if the alpha bytes are all 0xff, else 4
+} RawImageHeader;
+
+#endif
@@ -15,6 +15,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <fcntl.h>
@@ -22,6 +23,7 @@
 
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <linux/fb.h>
@@ -32,6 +34,15 @@
 #include <png.h>
 
 #include "minui.h"
+#include "raw_image.h"
+
+// What a gr_surface points at.  Decoded pixels follow the struct in the
+// same allocation; pre-decoded ones stay in the mapped file.
+typedef struct {
+    GGLSurface surface;
+    void* map;
+    size_t map_size;
+} ResSurface;
 
 // libpng gives "undefined reference to 'pow'" errors, and I have no
 // idea how to convince the build system to link with -lm.  We don't
@@ -41,17 +52,74 @@ double pow(double x, double y) {
     return x;
 }
 
+// Maps /res/images/<name>.raw, made from the png at build time.
+static int res_map_raw(const char* name, gr_surface* pSurface) {
+    char resPath[256];
+    RawImageHeader header;
+    struct stat st;
+    void* map;
+
+    snprintf(resPath, sizeof(resPath)-1, "/res/images/%s.raw", name);
+    resPath[sizeof(resPath)-1] = '\0';
+    int fd = open(resPath, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0 ||
+        read(fd, &header, sizeof(header)) != sizeof(header) ||
+        header.magic != RAW_IMAGE_MAGIC ||
+        (header.channels != 3 && header.channels != 4) ||
+        st.st_size != (off_t) (sizeof(header) +
+                               4 * header.width * header.height)) {
+        fprintf(stderr, "ignoring bad image %s\n", resPath);
+        close(fd);
+        return -2;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -3;
+    }
+
+    ResSurface* res = malloc(sizeof(ResSurface));
+    if (res == NULL) {
+        munmap(map, st.st_size);
+        return -4;
+    }
+    GGLSurface* surface = &res->surface;
+    surface->version = sizeof(GGLSurface);
+    surface->width = header.width;
+    surface->height = header.height;
+    surface->stride = header.width; /* Yes, pixels, not bytes */
+    surface->data = (GGLubyte*) map + sizeof(header);
+    surface->format = (header.channels == 3) ?
+            GGL_PIXEL_FORMAT_RGBX_8888 : GGL_PIXEL_FORMAT_RGBA_8888;
+    res->map = map;
+    res->map_size = st.st_size;
+
+    *pSurface = (gr_surface) surface;
+    return 0;
+}
+
 int res_create_surface(const char* name, gr_surface* pSurface) {
     char resPath[256];
+    ResSurface* res = NULL;
     GGLSurface* surface = NULL;
     int result = 0;
     unsigned char header[8];
     png_structp png_ptr = NULL;
     png_infop info_ptr = NULL;
+    FILE* fp = NULL;
+
+    if (res_map_raw(name, pSurface) == 0) {
+        return 0;
+    }
 
     snprintf(resPath, sizeof(resPath)-1, "/res/images/%s.png", name);
     resPath[sizeof(resPath)-1] = '\0';
-    FILE* fp = fopen(resPath, "rb");
+    fp = fopen(resPath, "rb");
     if (fp == NULL) {
         result = -1;
         goto exit;
@@ -105,12 +173,15 @@ int res_create_surface(const char* name, gr_surface* pSurface) {
         goto exit;
     }
 
-    surface = malloc(sizeof(GGLSurface) + pixelSize);
-    if (surface == NULL) {
+    res = malloc(sizeof(ResSurface) + pixelSize);
+    if (res == NULL) {
         result = -8;
         goto exit;
     }
-    unsigned char* pData = (unsigned char*) (surface + 1);
+    res->map = NULL;
+    res->map_size = 0;
+    surface = &res->surface;
+    unsigned char* pData = (unsigned char*) (res + 1);
     surface->version = sizeof(GGLSurface);
     surface->width = width;
     surface->height = height;
@@ -159,16 +230,19 @@ exit:
         fclose(fp);
     }
     if (result < 0) {
-        if (surface) {
-            free(surface);
+        if (res) {
+            free(res);
         }
     }
     return result;
 }
 
 void res_free_surface(gr_surface surface) {
-    GGLSurface* pSurface = (GGLSurface*) surface;
-    if (pSurface) {
-        free(pSurface);
+    ResSurface* res = (ResSurface*) surface;
+    if (res) {
+        if (res->map) {
+            munmap(res->map, res->map_size);
+        }
+        free(res);
     }
 }
@@ -25,6 +25,14 @@
 
 #define SORT_ENTRIES 1
 
+/*
+ * When set, the local file headers are not touched while parsing the
+ * central directory.  Each entry's data offset is resolved the first time
+ * it's looked up or extracted, so opening a large package only faults in
+ * the pages holding the central directory instead of one page per entry.
+ */
+#define LAZY_LOCAL_HEADERS 1
+
 /*
  * Offset and length constants (java.util.zip naming convention).
  */
@@ -97,64 +105,109 @@ static void dumpEntry(const ZipEntry* pEntry)
 #endif
 
 /*
- * (This is a mzHashTableLookup callback.)
+ * Compute the hash code for a ZipEntry filename.
  *
- * Compare two ZipEntry structs, by name.
+ * This is the 32-bit MurmurHash3 mix, consuming four bytes per step.
+ * Entry names share long prefixes ("system/app/", "system/lib/", ...),
+ * which the old multiply-by-31 loop handled poorly.
  */
-static int hashcmpZipEntry(const void* ventry1, const void* ventry2)
+static unsigned int computeHash(const char* name, unsigned int nameLen)
 {
-    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
-    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
+    const unsigned char* p = (const unsigned char*) name;
+    unsigned int hash = nameLen;
+    unsigned int k;
+
+    while (nameLen >= 4) {
+        k = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+        k *= 0xcc9e2d51;
+        k = (k << 15) | (k >> 17);
+        k *= 0x1b873593;
+        hash ^= k;
+        hash = (hash << 13) | (hash >> 19);
+        hash = hash * 5 + 0xe6546b64;
+        p += 4;
+        nameLen -= 4;
+    }
+
+    k = 0;
+    switch (nameLen) {
+    case 3: k ^= p[2] << 16;    /* fall through */
+    case 2: k ^= p[1] << 8;     /* fall through */
+    case 1: k ^= p[0];
+        k *= 0xcc9e2d51;
+        k = (k << 15) | (k >> 17);
+        k *= 0x1b873593;
+        hash ^= k;
+    }
 
-    if (entry1->fileNameLen != entry2->fileNameLen)
-        return entry1->fileNameLen - entry2->fileNameLen;
-    return memcmp(entry1->fileName, entry2->fileName, entry1->fileNameLen);
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
 }
 
 /*
- * (This is a mzHashTableLookup callback.)
- *
- * find a ZipEntry struct by name.
+ * Allocate an empty lookup table with room for "numEntries" names,
+ * keeping the load factor at or below 50%.
  */
-static int hashcmpZipName(const void* ventry, const void* vname)
+static bool createHashTable(ZipArchive* pArchive, unsigned int numEntries)
 {
-    const ZipEntry* entry = (const ZipEntry*) ventry;
-    const char* name = (const char*) vname;
-    unsigned int nameLen = strlen(name);
+    unsigned int size = 1;
 
-    if (entry->fileNameLen != nameLen)
-        return entry->fileNameLen - nameLen;
-    return memcmp(entry->fileName, name, nameLen);
+    while (size < numEntries * 2)
+        size <<= 1;
+
+    pArchive->pHash = (ZipHashSlot*) calloc(size, sizeof(ZipHashSlot));
+    if (pArchive->pHash == NULL)
+        return false;
+    pArchive->hashSize = size;
+    return true;
 }
 
 /*
- * Compute the hash code for a ZipEntry filename.
- *
- * Not expected to be compatible with any other hash function, so we init
- * to 2 to ensure it doesn't happen to match.
+ * Probe for "name" in the lookup table.  Returns the matching slot, or
+ * the empty slot where it would go.
  */
-static unsigned int computeHash(const char* name, int nameLen)
+static ZipHashSlot* findHashSlot(const ZipArchive* pArchive,
+        unsigned int hash, const char* name, unsigned int nameLen)
 {
-    unsigned int hash = 2;
+    unsigned int mask = pArchive->hashSize - 1;
+    unsigned int idx = hash & mask;
 
-    while (nameLen--)
-        hash = hash * 31 + *name++;
-
-    return hash;
+    while (true) {
+        ZipHashSlot* pSlot = &pArchive->pHash[idx];
+        if (pSlot->entryIdx == 0) {
+            return pSlot;
+        }
+        if (pSlot->hash == hash && pSlot->nameLen == nameLen &&
+            memcmp(pArchive->pEntries[pSlot->entryIdx - 1].fileName,
+                    name, nameLen) == 0)
+        {
+            return pSlot;
+        }
+        idx = (idx + 1) & mask;
+    }
 }
 
-static void addEntryToHashTable(HashTable* pHash, ZipEntry* pEntry)
+static void addEntryToHashTable(ZipArchive* pArchive, unsigned int index)
 {
+    const ZipEntry* pEntry = &pArchive->pEntries[index];
     unsigned int itemHash = computeHash(pEntry->fileName, pEntry->fileNameLen);
-    const ZipEntry* found;
+    ZipHashSlot* pSlot;
 
-    found = (const ZipEntry*)mzHashTableLookup(pHash,
-                itemHash, pEntry, hashcmpZipEntry, true);
-    if (found != pEntry) {
+    pSlot = findHashSlot(pArchive, itemHash,
+                pEntry->fileName, pEntry->fileNameLen);
+    if (pSlot->entryIdx != 0) {
         LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
-            found->fileNameLen, found->fileName);
+            pEntry->fileNameLen, pEntry->fileName);
         /* keep going */
+        return;
     }
+    pSlot->hash = itemHash;
+    pSlot->nameLen = pEntry->fileNameLen;
+    pSlot->entryIdx = index + 1;
 }
 
 static int validFilename(const char *fileName, unsigned int fileNameLen)
@@ -177,6 +230,52 @@ static int validFilename(const char *fileName, unsigned int fileNameLen)
     return 1;
 }
 
+/*
+ * Find the start of an entry's data by looking at its local file header,
+ * whose name and extra field lengths may differ from the central
+ * directory's copy.  The result is cached in pEntry->offset.
+ *
+ * Returns "true" on success.
+ */
+static bool resolveEntryOffset(const MemMapping* pMap, ZipEntry* pEntry)
+{
+    const unsigned char* localHdr;
+
+    if (pEntry->offset >= 0)
+        return true;
+
+    // Perform pMap->addr + localHdrOffset, ensuring that it won't
+    // overflow. This is needed because localHdrOffset is untrusted.
+    if (!safe_add((uintptr_t *)&localHdr, (uintptr_t)pMap->addr,
+        (uintptr_t)pEntry->localHdrOffset)) {
+        LOGW("Integer overflow adding in resolveEntryOffset\n");
+        return false;
+    }
+    if ((uintptr_t)localHdr + LOCHDR >
+        (uintptr_t)pMap->addr + pMap->length) {
+        LOGW("Bad offset to local header: %ld\n", pEntry->localHdrOffset);
+        return false;
+    }
+    if (get4LE(localHdr) != LOCSIG) {
+        LOGW("Missed a local header sig for '%.*s'\n",
+            pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+    long offset = pEntry->localHdrOffset + LOCHDR
+        + get2LE(localHdr + LOCNAM) + get2LE(localHdr + LOCEXT);
+    if (!safe_add(NULL, offset, pEntry->compLen)) {
+        LOGW("Integer overflow adding in resolveEntryOffset\n");
+        return false;
+    }
+    if ((size_t)offset + pEntry->compLen > pMap->length) {
+        LOGW("Data ran off the end for '%.*s'\n",
+            pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+    pEntry->offset = offset;
+    return true;
+}
+
 /*
  * Parse the contents of a Zip archive.  After confirming that the file
  * is in fact a Zip, we scan out the contents of the central directory and
@@ -241,15 +340,13 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
      */
     pArchive->numEntries = numEntries;
     pArchive->pEntries = (ZipEntry*) calloc(numEntries, sizeof(ZipEntry));
-    pArchive->pHash = mzHashTableCreate(mzHashSize(numEntries), NULL);
-    if (pArchive->pEntries == NULL || pArchive->pHash == NULL)
+    if (pArchive->pEntries == NULL || !createHashTable(pArchive, numEntries))
         goto bail;
 
     ptr = pMap->addr + cdOffset;
     for (i = 0; i < numEntries; i++) {
         ZipEntry* pEntry;
         unsigned int fileNameLen, extraLen, commentLen, localHdrOffset;
-        const unsigned char* localHdr;
         const char *fileName;
 
         if (ptr + CENHDR > (const unsigned char*)pMap->addr + pMap->length) {
@@ -352,39 +449,25 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         }
         pEntry->externalFileAttributes = get4LE(ptr + CENATX);
 
-        // Perform pMap->addr + localHdrOffset, ensuring that it won't
-        // overflow. This is needed because localHdrOffset is untrusted.
-        if (!safe_add((uintptr_t *)&localHdr, (uintptr_t)pMap->addr,
-            (uintptr_t)localHdrOffset)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
-            goto bail;
-        }
-        if ((uintptr_t)localHdr + LOCHDR >
-            (uintptr_t)pMap->addr + pMap->length) {
+        pEntry->localHdrOffset = localHdrOffset;
+        pEntry->offset = -1;
+        if ((size_t)localHdrOffset + LOCHDR > pMap->length) {
             LOGW("Bad offset to local header: %d (at %d)\n", localHdrOffset, i);
             goto bail;
         }
-        if (get4LE(localHdr) != LOCSIG) {
-            LOGW("Missed a local header sig (at %d)\n", i);
-            goto bail;
-        }
-        pEntry->offset = localHdrOffset + LOCHDR
-            + get2LE(localHdr + LOCNAM) + get2LE(localHdr + LOCEXT);
-        if (!safe_add(NULL, pEntry->offset, pEntry->compLen)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
-            goto bail;
-        }
-        if ((size_t)pEntry->offset + pEntry->compLen > pMap->length) {
-            LOGW("Data ran off the end (at %d)\n", i);
+#if !LAZY_LOCAL_HEADERS
+        if (!resolveEntryOffset(pMap, pEntry)) {
+            LOGW("Bad local header (at %d)\n", i);
             goto bail;
         }
+#endif
 
 #if !SORT_ENTRIES
         /* Add to hash table; no need to lock here.
          * Can't do this now if we're sorting, because entries
          * will move around.
          */
-        addEntryToHashTable(pArchive->pHash, pEntry);
+        addEntryToHashTable(pArchive, i);
 #endif
 
         //dumpEntry(pEntry);
@@ -399,7 +482,7 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
     for (i = 0; i < numEntries; i++) {
         /* Add to hash table; no need to lock here.
          */
-        addEntryToHashTable(pArchive->pHash, &pArchive->pEntries[i]);
+        addEntryToHashTable(pArchive, i);
     }
 #endif
 
@@ -407,7 +490,7 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
 
 bail:
     if (!result) {
-        mzHashTableFree(pArchive->pHash);
+        free(pArchive->pHash);
         pArchive->pHash = NULL;
     }
     return result;
@@ -490,7 +573,7 @@ void mzCloseZipArchive(ZipArchive* pArchive)
 
     free(pArchive->pEntries);
 
-    mzHashTableFree(pArchive->pHash);
+    free(pArchive->pHash);
 
     pArchive->fd = -1;
     pArchive->pHash = NULL;
@@ -505,10 +588,34 @@ void mzCloseZipArchive(ZipArchive* pArchive)
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName)
 {
-    unsigned int itemHash = computeHash(entryName, strlen(entryName));
+    size_t nameLen = strlen(entryName);
+    const ZipHashSlot* pSlot;
+    ZipEntry* pEntry;
+
+    if (pArchive->pHash == NULL)
+        return NULL;
+    pSlot = findHashSlot(pArchive, computeHash(entryName, nameLen),
+                entryName, nameLen);
+    if (pSlot->entryIdx == 0)
+        return NULL;
+    pEntry = &pArchive->pEntries[pSlot->entryIdx - 1];
+    if (!resolveEntryOffset(&pArchive->map, pEntry))
+        return NULL;
+    return pEntry;
+}
 
-    return (const ZipEntry*)mzHashTableLookup(pArchive->pHash,
-                itemHash, (char*) entryName, hashcmpZipName, false);
+/*
+ * Get the file offset of an entry's data, resolving its local header
+ * if that hasn't happened yet.
+ */
+long mzGetZipEntryOffset(const ZipArchive* pArchive, const ZipEntry* pEntry)
+{
+    /* The entry array is owned by the archive; the cached offset is
+     * the only thing we ever write back.
+     */
+    if (!resolveEntryOffset(&pArchive->map, (ZipEntry*) pEntry))
+        return -1;
+    return pEntry->offset;
 }
 
 /*
@@ -676,6 +783,9 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     bool ret = false;
     off_t oldOff;
 
+    if (mzGetZipEntryOffset(pArchive, pEntry) < 0)
+        return false;
+
     /* save current offset */
     oldOff = lseek(pArchive->fd, 0, SEEK_CUR);
 
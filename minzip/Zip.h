@@ -8,10 +8,10 @@
 
 #include "inline_magic.h"
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <utime.h>
 
-#include "Hash.h"
 #include "SysUtil.h"
 
 /*
@@ -25,7 +25,8 @@
 typedef struct ZipEntry {
     unsigned int fileNameLen;
     const char*  fileName;       // not null-terminated
-    long         offset;
+    long         offset;         // -1 until the local header is resolved
+    long         localHdrOffset;
     long         compLen;
     long         uncompLen;
     int          compression;
@@ -35,6 +36,17 @@ typedef struct ZipEntry {
     long         externalFileAttributes;
 } ZipEntry;
 
+/*
+ * One slot in the archive's name lookup table.  The name length and full
+ * hash are kept inline so that probing can reject almost every mismatch
+ * without touching the ZipEntry or the name bytes in the mapped file.
+ */
+typedef struct ZipHashSlot {
+    unsigned int   hash;
+    unsigned short nameLen;
+    unsigned short entryIdx;    // index into pEntries plus one; 0 is empty
+} ZipHashSlot;
+
 /*
  * One Zip archive.  Treat as opaque.
  */
@@ -42,7 +54,8 @@ typedef struct ZipArchive {
     int         fd;
     unsigned int numEntries;
     ZipEntry*   pEntries;
-    HashTable*  pHash;          // maps file name to ZipEntry
+    ZipHashSlot* pHash;         // maps file name to ZipEntry
+    unsigned int hashSize;      // number of slots, power of 2
     MemMapping  map;
 } ZipArchive;
 
@@ -114,9 +127,6 @@ INLINE UnterminatedString mzGetZipEntryFileName(const ZipEntry* pEntry) {
     ret.len = pEntry->fileNameLen;
     return ret;
 }
-INLINE long mzGetZipEntryOffset(const ZipEntry* pEntry) {
-    return pEntry->offset;
-}
 INLINE long mzGetZipEntryUncompLen(const ZipEntry* pEntry) {
     return pEntry->uncompLen;
 }
@@ -128,6 +138,13 @@ INLINE long mzGetZipEntryCrc32(const ZipEntry* pEntry) {
 }
 bool mzIsZipEntrySymlink(const ZipEntry* pEntry);
 
+/*
+ * Get the file offset of an entry's data.  The local header is only
+ * examined the first time this (or a lookup/extraction) needs it, so
+ * this can fail; returns -1 if the local header is invalid.
+ */
+long mzGetZipEntryOffset(const ZipArchive* pArchive, const ZipEntry* pEntry);
+
 
 /*
  * Type definition for the callback function used by
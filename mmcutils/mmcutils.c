@@ -38,6 +38,10 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/mount.h>  // for _IOW, _IOR, mount()
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
 
 #include "mmcutils.h"
 
@@ -57,10 +61,19 @@ struct MmcPartition {
     unsigned dsize;
 };
 
+/* Open addressed index over partition names and device paths; each
+ * slot holds a partition index + 1, or 0 if empty.
+ */
+#define NAME_HASH_SIZE (MAX_PARTITIONS * 4)
+
 typedef struct {
     MmcPartition *partitions;
     int partitions_allocd;
     int partition_count;
+    unsigned char name_hash[NAME_HASH_SIZE];
+    // The device the table was read from, to tell when it's stale
+    dev_t table_rdev;
+    time_t table_mtime;
 } MmcState;
 
 static MmcState g_mmc_state = {
@@ -203,10 +216,15 @@ mmc_read_mbr (const char *device, MmcPartition *mbr) {
         mbr[mmc_partition_count].device_index = strdup(device_index);
 
         mmc_partition_count++;
+        dfirstsec = GET_LWORD_FROM_BYTE(&buffer[TABLE_ENTRY_1 + OFFSET_FIRST_SEC]);
         if (mmc_partition_count == MAX_PARTITIONS)
+        {
+            if (dfirstsec != 0)
+                printf("Only the first %d partitions on %s are used; "
+                       "the rest are ignored\n", MAX_PARTITIONS, device);
             goto SUCCESS;
+        }
 
-        dfirstsec = GET_LWORD_FROM_BYTE(&buffer[TABLE_ENTRY_1 + OFFSET_FIRST_SEC]);
         if(dfirstsec == 0)
         {
             /* Getting to the end of the EBR tables */
@@ -228,10 +246,163 @@ ERROR2:
     return ret;
 }
 
+/* GPT layout, all little endian */
+#define GPT_SIGNATURE             "EFI PART"
+#define GPT_HEADER_LBA            1
+#define GPT_ENTRIES_LBA           72    // offsets within the header
+#define GPT_NUM_ENTRIES           80
+#define GPT_ENTRY_SIZE            84
+#define GPT_ENTRY_FIRST_LBA       32    // offsets within an entry
+#define GPT_ENTRY_LAST_LBA        40
+#define GPT_ENTRY_NAME            56
+#define GPT_ENTRY_NAME_LEN        36    // UTF-16 code units
+#define GPT_MIN_ENTRY_SIZE        128
+#define GPT_MAX_ENTRIES_BYTES     (128 * 128)
+
+static unsigned long long
+get_qword (const unsigned char *x) {
+    return (unsigned long long)GET_LWORD_FROM_BYTE(x + 4) << 32 |
+            GET_LWORD_FROM_BYTE(x);
+}
+
+/* GPT has no notion of filesystems; use the same names the MBR types map to. */
+static char *
+mmc_partition_filesystem (const char *name) {
+    int i;
+    for (i = 0; strcmp(ext3_partitions[i], "NONE"); i++)
+        if (!strcmp(ext3_partitions[i], name))
+            return strdup("ext3");
+    for (i = 0; strcmp(vfat_partitions[i], "NONE"); i++)
+        if (!strcmp(vfat_partitions[i], name))
+            return strdup("vfat");
+    return NULL;
+}
+
+/* Returns the number of partitions, or -1 if the device has no GPT. */
+static int
+mmc_read_gpt (const char *device, MmcPartition *gpt, int max) {
+    unsigned char header[BLOCK_SIZE];
+    unsigned char *entries = NULL;
+    int count = -1;
+    int fd;
+
+    fd = open(device, O_RDONLY | O_LARGEFILE);
+    if (fd < 0)
+        return -1;
+    if (pread(fd, header, sizeof(header), GPT_HEADER_LBA * BLOCK_SIZE) != sizeof(header) ||
+        memcmp(header, GPT_SIGNATURE, strlen(GPT_SIGNATURE)))
+        goto done;
+
+    unsigned long long entries_lba = get_qword(&header[GPT_ENTRIES_LBA]);
+    unsigned num_entries = GET_LWORD_FROM_BYTE(&header[GPT_NUM_ENTRIES]);
+    unsigned entry_size = GET_LWORD_FROM_BYTE(&header[GPT_ENTRY_SIZE]);
+    if (entry_size < GPT_MIN_ENTRY_SIZE || num_entries == 0 ||
+        num_entries > GPT_MAX_ENTRIES_BYTES / entry_size) {
+        printf("Bad GPT header on %s\n", device);
+        goto done;
+    }
+
+    // The whole entry array in one read
+    size_t len = num_entries * entry_size;
+    entries = malloc(len);
+    if (entries == NULL ||
+        pread64(fd, entries, len, (off64_t)entries_lba * BLOCK_SIZE) != (ssize_t)len) {
+        printf("Can't read GPT entries on %s\n", device);
+        goto done;
+    }
+
+    unsigned i;
+    count = 0;
+    for (i = 0; i < num_entries && count < max; i++) {
+        const unsigned char *e = entries + i * entry_size;
+        static const unsigned char unused[16];
+        if (!memcmp(e, unused, sizeof(unused)))
+            continue;   // unused entry; its number stays reserved
+
+        char name[GPT_ENTRY_NAME_LEN + 1];
+        int c;
+        for (c = 0; c < GPT_ENTRY_NAME_LEN; c++) {
+            unsigned ch = e[GPT_ENTRY_NAME + 2 * c] | e[GPT_ENTRY_NAME + 2 * c + 1] << 8;
+            if (ch == 0)
+                break;
+            name[c] = ch < 0x80 ? ch : '?';
+        }
+        name[c] = '\0';
+
+        char device_index[128];
+        unsigned long long first = get_qword(e + GPT_ENTRY_FIRST_LBA);
+        unsigned long long last = get_qword(e + GPT_ENTRY_LAST_LBA);
+        MmcPartition *p = &gpt[count++];
+        p->dfirstsec = first;
+        p->dsize = last >= first ? last - first + 1 : 0;
+        p->name = c > 0 ? strdup(name) : NULL;
+        p->filesystem = c > 0 ? mmc_partition_filesystem(name) : NULL;
+        sprintf(device_index, "%sp%u", device, i + 1);
+        p->device_index = strdup(device_index);
+    }
+
+    // Say so if used entries didn't fit, or their names just go missing
+    for (; i < num_entries; i++) {
+        static const unsigned char unused[16];
+        if (memcmp(entries + i * entry_size, unused, sizeof(unused))) {
+            printf("Only the first %d GPT partitions on %s are used; "
+                   "%s%u and up are ignored\n", max, device, device, i + 1);
+            break;
+        }
+    }
+
+done:
+    free(entries);
+    close(fd);
+    return count;
+}
+
+static unsigned
+name_hash (const char *s) {
+    unsigned h = 2166136261u;   // FNV-1a
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+static void
+name_hash_add (const char *key, int index) {
+    unsigned slot = name_hash(key) % NAME_HASH_SIZE;
+    while (g_mmc_state.name_hash[slot] != 0)
+        slot = (slot + 1) % NAME_HASH_SIZE;
+    g_mmc_state.name_hash[slot] = index + 1;
+}
+
+/* Index both the name and the device path; one can't be mistaken for the
+ * other since only device paths start with '/'.  Like the lookups always
+ * did, partitions without a name aren't findable.
+ */
+static void
+build_name_hash () {
+    int i;
+    memset(g_mmc_state.name_hash, 0, sizeof(g_mmc_state.name_hash));
+    for (i = 0; i < g_mmc_state.partition_count; i++) {
+        MmcPartition *p = &g_mmc_state.partitions[i];
+        if (p->device_index != NULL && p->name != NULL) {
+            name_hash_add(p->name, i);
+            name_hash_add(p->device_index, i);
+        }
+    }
+}
+
 int
 mmc_scan_partitions() {
     int i;
-    ssize_t nbytes;
+    struct stat st;
+
+    // Reuse the table if the device hasn't changed since we read it
+    if (stat(MMC_DEVICENAME, &st) != 0) {
+        memset(&st, 0, sizeof(st));
+    } else if (g_mmc_state.partition_count >= 0 &&
+        g_mmc_state.table_rdev == st.st_rdev &&
+        g_mmc_state.table_mtime == st.st_mtime) {
+        return g_mmc_state.partition_count;
+    }
 
     if (g_mmc_state.partitions == NULL) {
         const int nump = MAX_PARTITIONS;
@@ -268,50 +439,39 @@ mmc_scan_partitions() {
         }
     }
 
-    g_mmc_state.partition_count = mmc_read_mbr(MMC_DEVICENAME, g_mmc_state.partitions);
+    g_mmc_state.partition_count = mmc_read_gpt(MMC_DEVICENAME,
+            g_mmc_state.partitions, g_mmc_state.partitions_allocd);
+    if (g_mmc_state.partition_count == -1)
+        g_mmc_state.partition_count = mmc_read_mbr(MMC_DEVICENAME, g_mmc_state.partitions);
     if(g_mmc_state.partition_count == -1)
     {
         printf("Error in reading mbr!\n");
         // keep "partitions" around so we can free the names on a rescan.
         g_mmc_state.partition_count = -1;
+        memset(g_mmc_state.name_hash, 0, sizeof(g_mmc_state.name_hash));
+        return -1;
     }
-    return g_mmc_state.partition_count;
-}
 
-static const MmcPartition *
-mmc_find_partition_by_device_index(const char *device_index)
-{
-    if (g_mmc_state.partitions != NULL) {
-        int i;
-        for (i = 0; i < g_mmc_state.partitions_allocd; i++) {
-            MmcPartition *p = &g_mmc_state.partitions[i];
-            if (p->device_index !=NULL && p->name != NULL) {
-                if (strcmp(p->device_index, device_index) == 0) {
-                    return p;
-                }
-            }
-        }
-    }
-    return NULL;
+    build_name_hash();
+    g_mmc_state.table_rdev = st.st_rdev;
+    g_mmc_state.table_mtime = st.st_mtime;
+    return g_mmc_state.partition_count;
 }
 
 const MmcPartition *
 mmc_find_partition_by_name(const char *name)
 {
-    if (name[0] == '/') {
-        return mmc_find_partition_by_device_index(name);
-    }
-
-    if (g_mmc_state.partitions != NULL) {
-        int i;
-        for (i = 0; i < g_mmc_state.partitions_allocd; i++) {
-            MmcPartition *p = &g_mmc_state.partitions[i];
-            if (p->device_index !=NULL && p->name != NULL) {
-                if (strcmp(p->name, name) == 0) {
-                    return p;
-                }
-            }
-        }
+    if (g_mmc_state.partitions == NULL || g_mmc_state.partition_count <= 0)
+        return NULL;
+
+    // Device paths are looked up by their device_index
+    int by_device = name[0] == '/';
+    unsigned slot = name_hash(name) % NAME_HASH_SIZE;
+    while (g_mmc_state.name_hash[slot] != 0) {
+        MmcPartition *p = &g_mmc_state.partitions[g_mmc_state.name_hash[slot] - 1];
+        if (strcmp(by_device ? p->device_index : p->name, name) == 0)
+            return p;
+        slot = (slot + 1) % NAME_HASH_SIZE;
     }
     return NULL;
 }
@@ -417,106 +577,253 @@ mmc_mount_partition(const MmcPartition *partition, const char *mount_point,
     return rv;
 }
 
-int
-mmc_raw_copy (const MmcPartition *partition, char *in_file) {
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
-    int ret = -1;
-    char *out_file = partition->device_index;
+#define COPY_BUFFER_SIZE          (1024 * 1024)
+#define COPY_BUFFER_ALIGN         4096    // page aligned for O_DIRECT
+#define DIRECT_IO_ALIGN           512     // O_DIRECT transfer granularity
+#define SENDFILE_CHUNK_SIZE       (16 * 1024 * 1024)
 
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
+static int
+write_fully (int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
 
-    out = fopen ( out_file,  "w" );
-    if (out == NULL)
-        goto ERROR2;
+/* Two buffers handed back and forth between a reader thread, which fills
+ * them from in_fd, and the calling thread, which writes them to out_fd.
+ * len[i] < 0 means buffer i is free; 0 is end of file.
+ */
+typedef struct {
+    int in_fd;
+    char *buf[2];
+    ssize_t len[2];
+    int error;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} CopyPipe;
+
+static ssize_t
+fill_buffer (int fd, char *buf) {
+    // Keep reads whole so the file offset stays aligned for O_DIRECT.
+    size_t got = 0;
+    while (got < COPY_BUFFER_SIZE) {
+        ssize_t n = read(fd, buf + got, COPY_BUFFER_SIZE - got);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        got += n;
+    }
+    return got;
+}
 
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
+static void *
+copy_reader (void *cookie) {
+    CopyPipe *cp = (CopyPipe *) cookie;
+    int i = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&cp->lock);
+        while (cp->len[i] >= 0 && !cp->stop)
+            pthread_cond_wait(&cp->cond, &cp->lock);
+        int stop = cp->stop;
+        pthread_mutex_unlock(&cp->lock);
+        if (stop)
+            break;
 
-    if (sz % 512)
-    {
-        while ( ( ch = fgetc ( in ) ) != EOF )
-            fputc ( ch, out );
+        ssize_t n = fill_buffer(cp->in_fd, cp->buf[i]);
+
+        pthread_mutex_lock(&cp->lock);
+        if (n < 0) {
+            cp->error = errno;
+            n = 0;
+        }
+        cp->len[i] = n;
+        pthread_cond_broadcast(&cp->cond);
+        pthread_mutex_unlock(&cp->lock);
+        if (n == 0)
+            break;
+        i ^= 1;
     }
-    else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
+    return NULL;
+}
+
+static int
+write_chunk (int fd, const char *data, size_t len) {
+    if (len % DIRECT_IO_ALIGN != 0) {
+        // O_DIRECT can't write the odd-sized tail; finish through the cache.
+        int flags = fcntl(fd, F_GETFL);
+        if (flags != -1 && (flags & O_DIRECT))
+            fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+    }
+    return write_fully(fd, data, len);
+}
+
+/* Copy with the reads running ahead of the writes (and the observer).
+ * Buffers are aligned so either fd may have been opened O_DIRECT.
+ */
+static int
+copy_double_buffered (int in_fd, int out_fd, MmcCopyObserver observer, void *cookie) {
+    CopyPipe cp;
+    pthread_t reader;
+    int threaded;
+    int ret = -1;
+    int i = 0;
+
+    memset(&cp, 0, sizeof(cp));
+    cp.in_fd = in_fd;
+    cp.len[0] = cp.len[1] = -1;
+    cp.buf[0] = memalign(COPY_BUFFER_ALIGN, COPY_BUFFER_SIZE);
+    cp.buf[1] = memalign(COPY_BUFFER_ALIGN, COPY_BUFFER_SIZE);
+    if (cp.buf[0] == NULL || cp.buf[1] == NULL)
+        goto done;
+    pthread_mutex_init(&cp.lock, NULL);
+    pthread_cond_init(&cp.cond, NULL);
+
+    threaded = pthread_create(&reader, NULL, copy_reader, &cp) == 0;
+
+    for (;;) {
+        ssize_t n;
+        if (threaded) {
+            pthread_mutex_lock(&cp.lock);
+            while (cp.len[i] < 0)
+                pthread_cond_wait(&cp.cond, &cp.lock);
+            n = cp.len[i];
+            errno = cp.error;
+            pthread_mutex_unlock(&cp.lock);
+        } else {
+            n = fill_buffer(in_fd, cp.buf[i]);
+            if (n < 0) {
+                n = 0;
+                cp.error = errno;
+            }
+        }
+        if (n == 0) {
+            if (cp.error == 0)
+                ret = 0;
+            break;
         }
+
+        if (write_chunk(out_fd, cp.buf[i], n) < 0)
+            break;
+        if (observer != NULL)
+            observer(cp.buf[i], n, cookie);
+
+        pthread_mutex_lock(&cp.lock);
+        cp.len[i] = -1;
+        pthread_cond_broadcast(&cp.cond);
+        pthread_mutex_unlock(&cp.lock);
+        i ^= 1;
     }
 
-    fsync(out);
-    ret = 0;
-ERROR1:
-    fclose ( out );
-ERROR2:
-    fclose ( in );
-ERROR3:
+    if (threaded) {
+        pthread_mutex_lock(&cp.lock);
+        cp.stop = 1;
+        pthread_cond_broadcast(&cp.cond);
+        pthread_mutex_unlock(&cp.lock);
+        pthread_join(reader, NULL);
+    }
+    pthread_cond_destroy(&cp.cond);
+    pthread_mutex_destroy(&cp.lock);
+done:
+    free(cp.buf[0]);
+    free(cp.buf[1]);
     return ret;
+}
+
+int
+mmc_copy_fd (int in_fd, int out_fd, MmcCopyObserver observer, void *cookie) {
+    int copied_any = 0;
+
+    if (observer == NULL) {
+        for (;;) {
+            ssize_t n = sendfile(out_fd, in_fd, NULL, SENDFILE_CHUNK_SIZE);
+            if (n == 0)
+                return 0;
+            if (n > 0) {
+                copied_any = 1;
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            // Older kernels only sendfile() to sockets; fall back to
+            // read/write unless we're already part way through.
+            if (copied_any || (errno != EINVAL && errno != ENOSYS))
+                return -1;
+            break;
+        }
+    }
 
+    return copy_double_buffered(in_fd, out_fd, observer, cookie);
 }
 
+/* Open a block device O_DIRECT when we can, so a partition sized copy
+ * neither thrashes the page cache nor leaves it all for the final fsync.
+ */
+static int
+open_for_copy (const char *path, int flags, int *direct) {
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISBLK(st.st_mode)) {
+        int fd = open(path, flags | O_DIRECT, 0666);
+        if (fd >= 0) {
+            *direct = 1;
+            return fd;
+        }
+    }
+    return open(path, flags, 0666);
+}
 
 int
-mmc_raw_dump_internal (const char* in_file, const char *out_file) {
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
+mmc_copy_file (const char *in_file, const char *out_file) {
+    int in_fd, out_fd;
+    int direct = 0;
     int ret = -1;
 
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
-
-    out = fopen ( out_file,  "w" );
-    if (out == NULL)
+    in_fd = open_for_copy(in_file, O_RDONLY | O_LARGEFILE, &direct);
+    if (in_fd < 0)
         goto ERROR2;
 
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
+    out_fd = open_for_copy(out_file, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, &direct);
+    if (out_fd < 0)
+        goto ERROR1;
 
-    if (sz % 512)
-    {
-        while ( ( ch = fgetc ( in ) ) != EOF )
-            fputc ( ch, out );
-    }
+    // sendfile() goes through the page cache, so don't mix it with O_DIRECT
+    if (direct)
+        ret = copy_double_buffered(in_fd, out_fd, NULL, NULL);
     else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
-        }
-    }
+        ret = mmc_copy_fd(in_fd, out_fd, NULL, NULL);
+    if (ret == 0 && fsync(out_fd) != 0)
+        ret = -1;
 
-    fsync(out);
-    ret = 0;
+    if (close(out_fd) != 0)
+        ret = -1;
 ERROR1:
-    fclose ( out );
+    close(in_fd);
 ERROR2:
-    fclose ( in );
-ERROR3:
     return ret;
+}
+
+int
+mmc_raw_copy (const MmcPartition *partition, char *in_file) {
+    return mmc_copy_file(in_file, partition->device_index);
+}
+
 
+int
+mmc_raw_dump_internal (const char* in_file, const char *out_file) {
+    return mmc_copy_file(in_file, out_file);
 }
 
 // TODO: refactor this to not be a giant copy paste mess
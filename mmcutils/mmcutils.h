@@ -30,6 +30,8 @@
 #ifndef MMCUTILS_H_
 #define MMCUTILS_H_
 
+#include <stddef.h>
+
 /* Some useful define used to access the MBR/EBR table */
 #define BLOCK_SIZE                0x200
 #define TABLE_ENTRY_0             0x1BE
@@ -86,6 +88,16 @@ int mmc_raw_write (const MmcPartition *partition, char *data, int data_size);
 int format_ext2_device(const char *device);
 int format_ext3_device(const char *device);
 
+/* Bulk copy helpers, shared by the raw partition routines and by
+ * recovery's own file copies.  If an observer is given, every chunk
+ * passes through a userspace buffer and is handed to it after being
+ * written; otherwise the kernel copies the data with sendfile() when
+ * it can.  Return 0 on success, -1 on error (errno is set).
+ */
+typedef void (*MmcCopyObserver)(const void *data, size_t len, void *cookie);
+int mmc_copy_fd (int in_fd, int out_fd, MmcCopyObserver observer, void *cookie);
+int mmc_copy_file (const char *in_file, const char *out_file);
+
 #endif  // MMCUTILS_H_
 
 
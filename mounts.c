@@ -19,6 +19,8 @@
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <unistd.h>
 #include <sys/mount.h>
 
 #include "mounts.h"
@@ -34,12 +36,19 @@ typedef struct {
     MountedVolume *volumes;
     int volumes_allocd;
     int volume_count;
+    /* /proc/mounts, kept open so poll() can tell us when the table
+     * changes; the table is only reparsed when it might be stale.
+     */
+    int watch_fd;
+    int stale;
 } MountsState;
 
 static MountsState g_mounts_state = {
     NULL,   // volumes
     0,      // volumes_allocd
-    0       // volume_count
+    0,      // volume_count
+    -1,     // watch_fd
+    1       // stale
 };
 
 static inline void
@@ -56,14 +65,94 @@ free_volume_internals(const MountedVolume *volume, int zero)
 
 #define PROC_MOUNTS_FILENAME   "/proc/mounts"
 
+/* Has anything been mounted or unmounted since we last looked?  The
+ * kernel flags a change on the open file with POLLPRI (and POLLERR).
+ */
+static int
+mounts_changed()
+{
+    struct pollfd pfd;
+
+    if (g_mounts_state.stale || g_mounts_state.watch_fd < 0) {
+        return 1;
+    }
+    pfd.fd = g_mounts_state.watch_fd;
+    pfd.events = POLLPRI;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) != 0) {
+        // Changed, or poll isn't usable on this kernel: reparse
+        return 1;
+    }
+    return 0;
+}
+
+/* Read the whole file, however long the mount table gets.
+ */
+static char *
+read_mounts(int fd, ssize_t *len)
+{
+    size_t alloc = 4096;
+    size_t used = 0;
+    char *buf = malloc(alloc);
+
+    if (buf == NULL || lseek(fd, 0, SEEK_SET) != 0) {
+        free(buf);
+        return NULL;
+    }
+    for (;;) {
+        if (used + 1 >= alloc) {
+            char *bigger = realloc(buf, alloc * 2);
+            if (bigger == NULL) {
+                free(buf);
+                return NULL;
+            }
+            buf = bigger;
+            alloc *= 2;
+        }
+        ssize_t n = read(fd, buf + used, alloc - used - 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            free(buf);
+            return NULL;
+        }
+        if (n == 0) break;
+        used += n;
+    }
+    buf[used] = '\0';
+    *len = used;
+    return buf;
+}
+
+/* Return the next whitespace separated field of the line at *p, NUL
+ * terminated in place, or NULL at the end of the line.
+ */
+static char *
+next_field(char **p)
+{
+    char *s = *p;
+    while (*s == ' ' || *s == '\t') s++;
+    if (*s == '\0') {
+        *p = s;
+        return NULL;
+    }
+    char *field = s;
+    while (*s != '\0' && *s != ' ' && *s != '\t') s++;
+    if (*s != '\0') *s++ = '\0';
+    *p = s;
+    return field;
+}
+
 int
 scan_mounted_volumes()
 {
-    char buf[2048];
-    const char *bufp;
-    int fd;
+    char *buf;
+    char *line;
     ssize_t nbytes;
 
+    if (!mounts_changed()) {
+        return 0;
+    }
+
     if (g_mounts_state.volumes == NULL) {
         const int numv = 32;
         MountedVolume *volumes = malloc(numv * sizeof(*volumes));
@@ -83,19 +172,20 @@ scan_mounted_volumes()
         }
     }
     g_mounts_state.volume_count = 0;
+    g_mounts_state.stale = 1;
 
     /* Open and read the file contents.
      */
-    fd = open(PROC_MOUNTS_FILENAME, O_RDONLY);
-    if (fd < 0) {
-        goto bail;
+    if (g_mounts_state.watch_fd < 0) {
+        g_mounts_state.watch_fd = open(PROC_MOUNTS_FILENAME, O_RDONLY);
+        if (g_mounts_state.watch_fd < 0) {
+            goto bail;
+        }
     }
-    nbytes = read(fd, buf, sizeof(buf) - 1);
-    close(fd);
-    if (nbytes < 0) {
+    buf = read_mounts(g_mounts_state.watch_fd, &nbytes);
+    if (buf == NULL) {
         goto bail;
     }
-    buf[nbytes] = '\0';
 
     /* Parse the contents of the file, which looks like:
      *
@@ -111,24 +201,35 @@ scan_mounted_volumes()
      * The zeroes at the end are dummy placeholder fields to make the
      * output match Linux's /etc/mtab, but don't represent anything here.
      */
-    bufp = buf;
-    while (nbytes > 0) {
-        char device[64];
-        char mount_point[64];
-        char filesystem[64];
-        char flags[128];
-        int matches;
-
-        /* %as is a gnu extension that malloc()s a string for each field.
-         */
-        matches = sscanf(bufp, "%63s %63s %63s %127s",
-                device, mount_point, filesystem, flags);
+    line = buf;
+    while (line < buf + nbytes) {
+        char *next = strchr(line, '\n');
+        if (next != NULL) {
+            *next++ = '\0';
+        } else {
+            next = buf + nbytes;
+        }
+
+        char *p = line;
+        char *device = next_field(&p);
+        char *mount_point = next_field(&p);
+        char *filesystem = next_field(&p);
+        char *flags = next_field(&p);
 
-        if (matches == 4) {
-            device[sizeof(device)-1] = '\0';
-            mount_point[sizeof(mount_point)-1] = '\0';
-            filesystem[sizeof(filesystem)-1] = '\0';
-            flags[sizeof(flags)-1] = '\0';
+        if (flags != NULL) {
+            if (g_mounts_state.volume_count == g_mounts_state.volumes_allocd) {
+                int numv = g_mounts_state.volumes_allocd * 2;
+                MountedVolume *volumes = realloc(g_mounts_state.volumes,
+                        numv * sizeof(*volumes));
+                if (volumes == NULL) {
+                    free(buf);
+                    goto bail;
+                }
+                memset(volumes + g_mounts_state.volumes_allocd, 0,
+                        (numv - g_mounts_state.volumes_allocd) * sizeof(*volumes));
+                g_mounts_state.volumes = volumes;
+                g_mounts_state.volumes_allocd = numv;
+            }
 
             MountedVolume *v =
                     &g_mounts_state.volumes[g_mounts_state.volume_count++];
@@ -136,30 +237,34 @@ scan_mounted_volumes()
             v->mount_point = strdup(mount_point);
             v->filesystem = strdup(filesystem);
             v->flags = strdup(flags);
-        } else {
-printf("matches was %d on <<%.40s>>\n", matches, bufp);
+        } else if (device != NULL) {
+printf("short line <<%.40s>> in %s\n", line, PROC_MOUNTS_FILENAME);
         }
 
-        /* Eat the line.
-         */
-        while (nbytes > 0 && *bufp != '\n') {
-            bufp++;
-            nbytes--;
-        }
-        if (nbytes > 0) {
-            bufp++;
-            nbytes--;
-        }
+        line = next;
     }
+    free(buf);
 
+    g_mounts_state.stale = 0;
     return 0;
 
 bail:
-//TODO: free the strings we've allocated.
+    {
+        int i;
+        for (i = 0; i < g_mounts_state.volume_count; i++) {
+            free_volume_internals(&g_mounts_state.volumes[i], 1);
+        }
+    }
     g_mounts_state.volume_count = 0;
     return -1;
 }
 
+void
+invalidate_mounted_volumes()
+{
+    g_mounts_state.stale = 1;
+}
+
 const MountedVolume *
 find_mounted_volume_by_device(const char *device)
 {
@@ -208,6 +313,7 @@ unmount_mounted_volume(const MountedVolume *volume)
     int ret = umount(volume->mount_point);
     if (ret == 0) {
         free_volume_internals(volume, 1);
+        g_mounts_state.stale = 1;
         return 0;
     }
     return ret;
@@ -216,6 +322,7 @@ unmount_mounted_volume(const MountedVolume *volume)
 int
 remount_read_only(const MountedVolume* volume)
 {
+    g_mounts_state.stale = 1;
     return mount(volume->device, volume->mount_point, volume->filesystem,
                  MS_NOATIME | MS_NODEV | MS_NODIRATIME |
                  MS_RDONLY | MS_REMOUNT, 0);
@@ -19,8 +19,14 @@
 
 typedef struct MountedVolume MountedVolume;
 
+/* Rereads /proc/mounts only when the kernel says the table changed
+ * since the last scan (or after invalidate_mounted_volumes()).
+ */
 int scan_mounted_volumes(void);
 
+/* Force the next scan to reread the table, e.g. after a mount(2). */
+void invalidate_mounted_volumes(void);
+
 const MountedVolume *find_mounted_volume_by_device(const char *device);
 
 const MountedVolume *
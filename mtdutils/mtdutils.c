@@ -23,6 +23,7 @@
 #include <sys/mount.h>  // for _IOW, _IOR, mount()
 #include <sys/stat.h>
 #include <mtd/mtd-user.h>
+#include <pthread.h>
 #undef NDEBUG
 #include <assert.h>
 
@@ -35,15 +36,37 @@ struct MtdReadContext {
     int fd;
 };
 
+/* Number of erase blocks that can be queued for the writer thread, in
+ * addition to the one the caller is filling.
+ */
+#define WRITE_QUEUE_BLOCKS 3
+
 struct MtdWriteContext {
     const MtdPartition *partition;
-    char *buffer;
+    char *buffer;           // block being filled by the caller
     size_t stored;
     int fd;
 
     off_t* bad_block_offsets;
     int bad_block_alloc;
     int bad_block_count;
+
+    // Complete blocks are erased, programmed and verified by a writer
+    // thread, so the caller can produce the next block meanwhile.
+    // Slots [queue_head, queue_head + queued) are waiting to be
+    // written; the slot after them is "buffer".  Anything that looks
+    // at the file position or the bad block list drains the queue
+    // first.
+    char *slots[WRITE_QUEUE_BLOCKS + 1];
+    char *verify;
+    int queue_head;
+    int queued;
+    int writer_error;       // errno of the first failed block, or 0
+    int writer_started;
+    int writer_stop;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
 };
 
 typedef struct {
@@ -134,6 +157,12 @@ mtd_scan_partitions()
          */
         if (matches == 4) {
             MtdPartition *p = &g_mtd_state.partitions[mtdnum];
+            if (p->size != (unsigned) mtdsize ||
+                p->erase_size != (unsigned) mtderasesize) {
+                // The layout changed; rescan bad blocks on next read.
+                free(p->bad_block_map);
+                p->bad_block_map = NULL;
+            }
             p->device_index = mtdnum;
             p->size = mtdsize;
             p->erase_size = mtderasesize;
@@ -247,6 +276,54 @@ mtd_partition_info(const MtdPartition *partition,
     return 0;
 }
 
+/* Values in a partition's bad_block_map, one byte per erase block.
+ * Blocks are only asked about (with MEMGETBADBLOCK) when a read first
+ * reaches them, so opening a partition doesn't cost a pass over all of
+ * it, and each answer is remembered for later reads.
+ */
+#define BLOCK_UNKNOWN   0
+#define BLOCK_GOOD      1
+#define BLOCK_BAD       2
+
+static int alloc_bad_block_map(const MtdPartition *partition)
+{
+    if (partition->bad_block_map != NULL) return 0;
+
+    unsigned int blocks = partition->size / partition->erase_size;
+    unsigned char *map = calloc(blocks, 1);
+    if (map == NULL) return -1;
+    ((MtdPartition *) partition)->bad_block_map = map;
+    return 0;
+}
+
+/* A failed erase or write can get a block marked bad by the driver, so
+ * writing throws away what reads have learned about the partition.
+ * (Reads and writes of one partition are never open at the same time.)
+ */
+static void forget_bad_blocks(const MtdPartition *partition)
+{
+    free(partition->bad_block_map);
+    ((MtdPartition *) partition)->bad_block_map = NULL;
+}
+
+static int is_bad_block(const MtdPartition *partition, int fd, loff_t pos)
+{
+    unsigned char *state = &partition->bad_block_map[pos / partition->erase_size];
+    if (*state == BLOCK_UNKNOWN) {
+        loff_t bpos = pos;
+        int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
+        if (ret != 0 && !(ret == -1 && errno == EOPNOTSUPP)) {
+            fprintf(stderr,
+                    "mtd: MEMGETBADBLOCK returned %d at 0x%08llx (errno=%d)\n",
+                    ret, pos, errno);
+            *state = BLOCK_BAD;
+        } else {
+            *state = BLOCK_GOOD;
+        }
+    }
+    return *state == BLOCK_BAD;
+}
+
 MtdReadContext *mtd_read_partition(const MtdPartition *partition)
 {
     MtdReadContext *ctx = (MtdReadContext*) malloc(sizeof(MtdReadContext));
@@ -267,6 +344,13 @@ MtdReadContext *mtd_read_partition(const MtdPartition *partition)
         return NULL;
     }
 
+    if (alloc_bad_block_map(partition)) {
+        close(ctx->fd);
+        free(ctx->buffer);
+        free(ctx);
+        return NULL;
+    }
+
     ctx->partition = partition;
     ctx->consumed = partition->erase_size;
     return ctx;
@@ -289,10 +373,11 @@ static int read_block(const MtdPartition *partition, int fd, char *data)
     loff_t pos = lseek64(fd, 0, SEEK_CUR);
 
     ssize_t size = partition->erase_size;
-    int mgbb;
 
     while (pos + size <= (int) partition->size) {
-        if (lseek64(fd, pos, SEEK_SET) != pos || read(fd, data, size) != size) {
+        if (is_bad_block(partition, fd, pos)) {
+            // already reported by is_bad_block()
+        } else if (lseek64(fd, pos, SEEK_SET) != pos || read(fd, data, size) != size) {
             fprintf(stderr, "mtd: read error at 0x%08llx (%s)\n",
                     pos, strerror(errno));
         } else if (ioctl(fd, ECCGETSTATS, &after)) {
@@ -304,10 +389,6 @@ static int read_block(const MtdPartition *partition, int fd, char *data)
                     after.failed - before.failed, pos);
             // copy the comparison baseline for the next read.
             memcpy(&before, &after, sizeof(struct mtd_ecc_stats));
-        } else if ((mgbb = ioctl(fd, MEMGETBADBLOCK, &pos))) {
-            fprintf(stderr,
-                    "mtd: MEMGETBADBLOCK returned %d at 0x%08llx (errno=%d)\n",
-                    mgbb, pos, errno);
         } else {
             return 0;  // Success!
         }
@@ -319,6 +400,51 @@ static int read_block(const MtdPartition *partition, int fd, char *data)
     return -1;
 }
 
+/* Read up to "count" whole erase blocks into data, skipping bad blocks.
+ * Consecutive good blocks are read with a single read() and one pair of
+ * ECCGETSTATS calls; only if that batch saw an ECC failure is it read
+ * again block by block to find (and skip) the failing block.
+ *
+ * Returns the number of blocks read, or -1 on error.
+ */
+static int read_blocks(const MtdPartition *partition, int fd, char *data,
+                       int count)
+{
+    loff_t pos = lseek64(fd, 0, SEEK_CUR);
+    ssize_t size = partition->erase_size;
+
+    while (pos + size <= (int) partition->size && is_bad_block(partition, fd, pos)) {
+        pos += size;
+    }
+    if (pos + size > (int) partition->size) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    int run = 1;
+    while (run < count && pos + (run + 1) * size <= (int) partition->size &&
+           !is_bad_block(partition, fd, pos + run * size)) {
+        ++run;
+    }
+
+    struct mtd_ecc_stats before, after;
+    if (ioctl(fd, ECCGETSTATS, &before) == 0 &&
+        lseek64(fd, pos, SEEK_SET) == pos &&
+        read(fd, data, run * size) == run * size &&
+        ioctl(fd, ECCGETSTATS, &after) == 0 &&
+        after.failed == before.failed) {
+        return run;
+    }
+
+    // Something in this batch failed; go through it one block at a time.
+    if (lseek64(fd, pos, SEEK_SET) != pos) return -1;
+    int i;
+    for (i = 0; i < run; ++i) {
+        if (read_block(partition, fd, data + i * size)) return -1;
+    }
+    return run;
+}
+
 ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
 {
     ssize_t read = 0;
@@ -334,8 +460,10 @@ ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
         // Read complete blocks directly into the user's buffer
         while (ctx->consumed == ctx->partition->erase_size &&
                len - read >= ctx->partition->erase_size) {
-            if (read_block(ctx->partition, ctx->fd, data + read)) return -1;
-            read += ctx->partition->erase_size;
+            int want = (len - read) / ctx->partition->erase_size;
+            int got = read_blocks(ctx->partition, ctx->fd, data + read, want);
+            if (got < 0) return -1;
+            read += got * ctx->partition->erase_size;
         }
 
         if (read >= (int)len) {
@@ -361,31 +489,34 @@ void mtd_read_close(MtdReadContext *ctx)
 
 MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
 {
-    MtdWriteContext *ctx = (MtdWriteContext*) malloc(sizeof(MtdWriteContext));
+    MtdWriteContext *ctx = (MtdWriteContext*) calloc(1, sizeof(MtdWriteContext));
     if (ctx == NULL) return NULL;
 
-    ctx->bad_block_offsets = NULL;
-    ctx->bad_block_alloc = 0;
-    ctx->bad_block_count = 0;
-
-    ctx->buffer = malloc(partition->erase_size);
-    if (ctx->buffer == NULL) {
-        free(ctx);
-        return NULL;
+    int i;
+    for (i = 0; i <= WRITE_QUEUE_BLOCKS; ++i) {
+        ctx->slots[i] = malloc(partition->erase_size);
+        if (ctx->slots[i] == NULL) goto fail;
     }
+    ctx->verify = malloc(partition->erase_size);
+    if (ctx->verify == NULL) goto fail;
 
     char mtddevname[32];
     sprintf(mtddevname, "/dev/mtd/mtd%d", partition->device_index);
     ctx->fd = open(mtddevname, O_RDWR);
-    if (ctx->fd < 0) {
-        free(ctx->buffer);
-        free(ctx);
-        return NULL;
-    }
+    if (ctx->fd < 0) goto fail;
 
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+    ctx->buffer = ctx->slots[0];
     ctx->partition = partition;
     ctx->stored = 0;
     return ctx;
+
+fail:
+    for (i = 0; i <= WRITE_QUEUE_BLOCKS; ++i) free(ctx->slots[i]);
+    free(ctx->verify);
+    free(ctx);
+    return NULL;
 }
 
 static void add_bad_block_offset(MtdWriteContext *ctx, off_t pos) {
@@ -397,6 +528,13 @@ static void add_bad_block_offset(MtdWriteContext *ctx, off_t pos) {
     ctx->bad_block_offsets[ctx->bad_block_count++] = pos;
 }
 
+/* True if the block is all 0xFF, i.e. what an erase leaves behind.
+ */
+static int is_erased_block(const char *data, size_t size)
+{
+    return (unsigned char) data[0] == 0xff && !memcmp(data, data + 1, size - 1);
+}
+
 static int write_block(MtdWriteContext *ctx, const char *data)
 {
     const MtdPartition *partition = ctx->partition;
@@ -406,6 +544,7 @@ static int write_block(MtdWriteContext *ctx, const char *data)
     if (pos == (off_t) -1) return 1;
 
     ssize_t size = partition->erase_size;
+    int erased = is_erased_block(data, size);
     while (pos + size <= (int) partition->size) {
         loff_t bpos = pos;
         int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
@@ -428,13 +567,15 @@ static int write_block(MtdWriteContext *ctx, const char *data)
                         pos, strerror(errno));
                 continue;
             }
-            if (lseek(fd, pos, SEEK_SET) != pos ||
-                write(fd, data, size) != size) {
+            // An erased block already holds all 0xFF; programming it
+            // would only cost time (and ECC bytes in the spare area).
+            if (!erased && (lseek(fd, pos, SEEK_SET) != pos ||
+                            write(fd, data, size) != size)) {
                 fprintf(stderr, "mtd: write error at 0x%08lx (%s)\n",
                         pos, strerror(errno));
             }
 
-            char verify[size];
+            char *verify = ctx->verify;
             if (lseek(fd, pos, SEEK_SET) != pos ||
                 read(fd, verify, size) != size) {
                 fprintf(stderr, "mtd: re-read error at 0x%08lx (%s)\n",
@@ -466,29 +607,126 @@ static int write_block(MtdWriteContext *ctx, const char *data)
     return -1;
 }
 
+static void *writer_thread(void *cookie)
+{
+    MtdWriteContext *ctx = (MtdWriteContext*) cookie;
+
+    pthread_mutex_lock(&ctx->lock);
+    for (;;) {
+        while (ctx->queued == 0 && !ctx->writer_stop) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        if (ctx->queued == 0) break;
+
+        char *data = ctx->slots[ctx->queue_head];
+        int failed = ctx->writer_error != 0;
+        pthread_mutex_unlock(&ctx->lock);
+
+        // After a failure, just drop whatever else was queued.
+        int error = 0;
+        if (!failed && write_block(ctx, data)) {
+            error = errno ? errno : EIO;
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        if (error && ctx->writer_error == 0) ctx->writer_error = error;
+        ctx->queue_head = (ctx->queue_head + 1) % (WRITE_QUEUE_BLOCKS + 1);
+        --ctx->queued;
+        pthread_cond_broadcast(&ctx->cond);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+/* Hand the full block in ctx->buffer to the writer thread and switch
+ * ctx->buffer to a free slot, waiting for one if the queue is full.
+ */
+static int queue_block(MtdWriteContext *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    if (!ctx->writer_started) {
+        if (pthread_create(&ctx->writer, NULL, writer_thread, ctx) != 0) {
+            pthread_mutex_unlock(&ctx->lock);
+            // No thread; write it ourselves.
+            return write_block(ctx, ctx->buffer) ? -1 : 0;
+        }
+        ctx->writer_started = 1;
+    }
+    ++ctx->queued;
+    pthread_cond_broadcast(&ctx->cond);
+    while (ctx->queued == WRITE_QUEUE_BLOCKS + 1) {
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    int next = (ctx->queue_head + ctx->queued) % (WRITE_QUEUE_BLOCKS + 1);
+    ctx->buffer = ctx->slots[next];
+    int error = ctx->writer_error;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/* Wait until every queued block has been written.  Returns -1 (with
+ * errno set) if any of them failed.
+ */
+static int drain_queue(MtdWriteContext *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->queued > 0) {
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    int error = ctx->writer_error;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
 ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
 {
     size_t wrote = 0;
     while (wrote < len) {
-        // Coalesce partial writes into complete blocks
-        if (ctx->stored > 0 || len - wrote < ctx->partition->erase_size) {
-            size_t avail = ctx->partition->erase_size - ctx->stored;
-            size_t copy = len - wrote < avail ? len - wrote : avail;
-            memcpy(ctx->buffer + ctx->stored, data + wrote, copy);
-            ctx->stored += copy;
-            wrote += copy;
-        }
+        size_t avail = ctx->partition->erase_size - ctx->stored;
+        size_t copy = len - wrote < avail ? len - wrote : avail;
+        memcpy(ctx->buffer + ctx->stored, data + wrote, copy);
+        ctx->stored += copy;
+        wrote += copy;
 
-        // If a complete block was accumulated, write it
+        // If a complete block was accumulated, queue it
         if (ctx->stored == ctx->partition->erase_size) {
-            if (write_block(ctx, ctx->buffer)) return -1;
+            if (queue_block(ctx)) return -1;
             ctx->stored = 0;
         }
+    }
+
+    return wrote;
+}
+
+ssize_t mtd_write_fd(MtdWriteContext *ctx, int fd, ssize_t len)
+{
+    ssize_t wrote = 0;
+    while (len < 0 || wrote < len) {
+        // Read straight into the block being filled, a block at a time
+        size_t want = ctx->partition->erase_size - ctx->stored;
+        if (len >= 0 && (size_t) (len - wrote) < want) want = len - wrote;
+        ssize_t r = read(fd, ctx->buffer + ctx->stored, want);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) break;
+        ctx->stored += r;
+        wrote += r;
 
-        // Write complete blocks directly from the user's buffer
-        while (ctx->stored == 0 && len - wrote >= ctx->partition->erase_size) {
-            if (write_block(ctx, data + wrote)) return -1;
-            wrote += ctx->partition->erase_size;
+        if (ctx->stored == ctx->partition->erase_size) {
+            if (queue_block(ctx)) return -1;
+            ctx->stored = 0;
         }
     }
 
@@ -501,9 +739,10 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
     if (ctx->stored > 0) {
         size_t zero = ctx->partition->erase_size - ctx->stored;
         memset(ctx->buffer + ctx->stored, 0, zero);
-        if (write_block(ctx, ctx->buffer)) return -1;
+        if (queue_block(ctx)) return -1;
         ctx->stored = 0;
     }
+    if (drain_queue(ctx)) return -1;
 
     off_t pos = lseek(ctx->fd, 0, SEEK_CUR);
     if ((off_t) pos == (off_t) -1) return pos;
@@ -541,9 +780,23 @@ int mtd_write_close(MtdWriteContext *ctx)
     int r = 0;
     // Make sure any pending data gets written
     if (mtd_erase_blocks(ctx, 0) == (off_t) -1) r = -1;
+
+    if (ctx->writer_started) {
+        pthread_mutex_lock(&ctx->lock);
+        ctx->writer_stop = 1;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+        pthread_join(ctx->writer, NULL);
+    }
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->lock);
+
     if (close(ctx->fd)) r = -1;
+    forget_bad_blocks(ctx->partition);
     free(ctx->bad_block_offsets);
-    free(ctx->buffer);
+    int i;
+    for (i = 0; i <= WRITE_QUEUE_BLOCKS; ++i) free(ctx->slots[i]);
+    free(ctx->verify);
     free(ctx);
     return r;
 }
@@ -553,6 +806,7 @@ int mtd_write_close(MtdWriteContext *ctx)
  */
 off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos) {
     int i;
+    drain_queue(ctx);
     for (i = 0; i < ctx->bad_block_count; ++i) {
         if (ctx->bad_block_offsets[i] == pos) {
             pos += ctx->partition->erase_size;
@@ -563,170 +817,191 @@ off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos) {
     return pos;
 }
 
-#define BLOCK_SIZE    2048
-#define SPARE_SIZE    (BLOCK_SIZE >> 5)
 #define HEADER_SIZE 2048
 
-int cmd_mtd_restore_raw_partition(const char *partition_name, const char *filename)
+/* Fill data with up to len bytes from fd, stopping early only at EOF.
+ */
+static ssize_t read_fully(int fd, char *data, size_t len)
 {
-    const MtdPartition *ptn;
-    MtdWriteContext *write;
-    void *data;
-    unsigned sz;
-
-    if (mtd_scan_partitions() <= 0)
-    {
-        printf("error scanning partitions");
-        return -1;
-    }
-    const MtdPartition *partition = mtd_find_partition_by_name(partition_name);
-    if (partition == NULL)
-    {
-        printf("can't find %s partition", partition_name);
-        return -1;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = read(fd, data + done, len - done);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) break;
+        done += r;
     }
+    return done;
+}
 
-    // If the first part of the file matches the partition, skip writing
-
-    int fd = open(filename, O_RDONLY);
-    if (fd < 0)
-    {
-        printf("error opening %s", filename);
+int mtd_write_image(const MtdPartition *partition, int fd)
+{
+    // Keep the whole first block around: it is written as zeros on the
+    // first pass, and for real once everything else is in place, so an
+    // interrupted flash never leaves a valid header over a bad image.
+    char *first = malloc(partition->erase_size);
+    if (first == NULL) return -1;
+    ssize_t firstlen = read_fully(fd, first, partition->erase_size);
+    if (firstlen < 0) {
+        fprintf(stderr, "mtd: error reading image header\n");
+        free(first);
         return -1;
     }
-
-    char header[HEADER_SIZE];
-    int headerlen = read(fd, header, sizeof(header));
-    if (headerlen <= 0)
-    {
-        printf("error reading %s header", filename);
-        return -1;
+    if (firstlen == 0) {
+        // A backup of a completely erased partition
+        free(first);
+        MtdWriteContext *out = mtd_write_partition(partition);
+        if (out == NULL) return -1;
+        if (mtd_erase_blocks(out, -1) == (off_t) -1) {
+            mtd_write_close(out);
+            return -1;
+        }
+        return mtd_write_close(out);
     }
+    ssize_t headerlen = firstlen < HEADER_SIZE ? firstlen : HEADER_SIZE;
 
+    // If the first part of the file matches the partition, skip writing
     MtdReadContext *in = mtd_read_partition(partition);
     if (in == NULL) {
-        printf("error opening %s: %s\n", partition, strerror(errno));
+        fprintf(stderr, "mtd: error opening %s: %s\n",
+                partition->name, strerror(errno));
         // just assume it needs re-writing
     } else {
         char check[HEADER_SIZE];
-        int checklen = mtd_read_data(in, check, sizeof(check));
+        ssize_t checklen = mtd_read_data(in, check, sizeof(check));
+        mtd_read_close(in);
         if (checklen <= 0) {
-            printf("error reading %s: %s\n", partition_name, strerror(errno));
+            fprintf(stderr, "mtd: error reading %s: %s\n",
+                    partition->name, strerror(errno));
             // just assume it needs re-writing
-        } else if (checklen == headerlen && !memcmp(header, check, headerlen)) {
-            printf("header is the same, not flashing %s\n", partition_name);
+        } else if (checklen >= headerlen && !memcmp(first, check, headerlen)) {
+            printf("header is the same, not flashing %s\n", partition->name);
+            free(first);
             return 0;
         }
-        mtd_read_close(in);
     }
 
-    // Skip the header (we'll come back to it), write everything else
-    printf("flashing %s from %s\n", partition_name, filename);
-
+    // Skip the header (we'll come back to it), write everything else.
+    // Backups leave out trailing erased blocks, so erase whatever the
+    // image doesn't cover.
     MtdWriteContext *out = mtd_write_partition(partition);
-    if (out == NULL)
-    {
-       printf("error writing %s", partition_name);
-       return -1;
+    if (out == NULL) goto fail;
+
+    char zero[HEADER_SIZE];
+    memset(zero, 0, headerlen);
+    if (mtd_write_data(out, zero, headerlen) != headerlen ||
+        mtd_write_data(out, first + headerlen, firstlen - headerlen) !=
+                firstlen - headerlen ||
+        mtd_write_fd(out, fd, -1) < 0 ||
+        mtd_erase_blocks(out, -1) == (off_t) -1) {
+        fprintf(stderr, "mtd: error flashing %s: %s\n",
+                partition->name, strerror(errno));
+        mtd_write_close(out);
+        goto fail;
     }
+    if (mtd_write_close(out)) goto fail;
 
-    char buf[HEADER_SIZE];
-    memset(buf, 0, headerlen);
-    int wrote = mtd_write_data(out, buf, headerlen);
-    if (wrote != headerlen)
-    {
-        printf("error writing %s", partition_name);
-        return -1;
-    }
-
-    int len;
-    while ((len = read(fd, buf, sizeof(buf))) > 0) {
-        wrote = mtd_write_data(out, buf, len);
-        if (wrote != len)
-        {
-            printf("error writing %s", partition_name);
-            return -1;
-        }
-    }
-    if (len < 0)
-    {
-       printf("error reading %s", filename);
-       return -1;
+    // Now come back and write the first block, header included
+    out = mtd_write_partition(partition);
+    if (out == NULL) goto fail;
+    if (mtd_write_data(out, first, firstlen) != firstlen) {
+        mtd_write_close(out);
+        goto fail;
     }
+    if (mtd_write_close(out)) goto fail;
 
-    if (mtd_write_close(out))
-    {
-        printf("error closing %s", partition_name);
-        return -1;
-    }
+    free(first);
+    return 0;
 
-    // Now come back and write the header last
+fail:
+    free(first);
+    return -1;
+}
 
-    out = mtd_write_partition(partition);
-    if (out == NULL)
+int cmd_mtd_restore_raw_partition(const char *partition_name, const char *filename)
+{
+    if (mtd_scan_partitions() <= 0)
     {
-        printf("error re-opening %s", partition_name);
+        printf("error scanning partitions");
         return -1;
     }
-
-    wrote = mtd_write_data(out, header, headerlen);
-    if (wrote != headerlen)
+    const MtdPartition *partition = mtd_find_partition_by_name(partition_name);
+    if (partition == NULL)
     {
-        printf("error re-writing %s", partition_name);
+        printf("can't find %s partition", partition_name);
         return -1;
     }
 
-    // Need to write a complete block, so write the rest of the first block
-    size_t block_size;
-    if (mtd_partition_info(partition, NULL, &block_size, NULL))
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
     {
-        printf("error getting %s block size", partition_name);
+        printf("error opening %s", filename);
         return -1;
     }
 
-    if (lseek(fd, headerlen, SEEK_SET) != headerlen)
-    {
-        printf("error rewinding %s", filename);
-        return -1;
-    }
+    printf("flashing %s from %s\n", partition_name, filename);
+    int ret = mtd_write_image(partition, fd);
+    if (ret != 0)
+        printf("error flashing %s", partition_name);
+    close(fd);
+    return ret;
+}
 
-    int left = block_size - headerlen;
-    while (left < 0) left += block_size;
-    while (left > 0) {
-        len = read(fd, buf, left > (int)sizeof(buf) ? (int)sizeof(buf) : left);
-        if (len <= 0){
-            printf("error reading %s", filename);
-            return -1;
-        }
-        if (mtd_write_data(out, buf, len) != len)
-        {
-            printf("error writing %s", partition_name);
-            return -1;
-        }
+/* Read this many erase blocks per mtd_read_data() call when backing up.
+ */
+#define BACKUP_BATCH_BLOCKS 16
 
-        left -= len;
-    }
+/* Read count whole blocks from the partition.  read_block() moves past
+ * blocks it can't read, so the last batch can come up short even though
+ * the bad block map said there was room; in that case go back and take
+ * what's left a block at a time.  Returns the number of blocks read.
+ */
+static int backup_read_blocks(MtdReadContext *in, char *data, int count)
+{
+    const size_t erase_size = in->partition->erase_size;
+    loff_t start = lseek64(in->fd, 0, SEEK_CUR);
+    if (mtd_read_data(in, data, count * erase_size) == (ssize_t) (count * erase_size))
+        return count;
+    if (count == 1 || lseek64(in->fd, start, SEEK_SET) != start)
+        return 0;
+
+    int got = 0;
+    while (got < count &&
+           mtd_read_data(in, data + got * erase_size, erase_size) == (ssize_t) erase_size)
+        ++got;
+    return got;
+}
 
-    if (mtd_write_close(out))
-    {
-        printf("error closing %s", partition_name);
-        return -1;
+/* Write len bytes of 0xFF, a block at a time.
+ */
+static int write_erased(int fd, const char *erased, size_t block, size_t len)
+{
+    while (len > 0) {
+        size_t n = len < block ? len : block;
+        if (write(fd, erased, n) != (ssize_t) n) return -1;
+        len -= n;
     }
     return 0;
 }
 
-
+/* The backup is the partition's good blocks, as before, but without the
+ * trailing erased blocks (boot and recovery are mostly empty).  Erased
+ * runs in the middle still have to be written out to keep the offsets
+ * of the data that follows; restore erases everything past the end of
+ * the image.
+ */
 int cmd_mtd_backup_raw_partition(const char *partition_name, const char *filename)
 {
     MtdReadContext *in;
     const MtdPartition *partition;
-    char buf[BLOCK_SIZE + SPARE_SIZE];
-    size_t partition_size;
-    size_t read_size;
-    size_t total;
+    char *buf;
+    char *erased;
+    size_t erase_size;
+    size_t pending;
+    unsigned int blocks, good, i;
     int fd;
-    int wrote;
-    int len;
 
     if (mtd_scan_partitions() <= 0)
     {
@@ -741,7 +1016,7 @@ int cmd_mtd_backup_raw_partition(const char *partition_name, const char *filenam
         return -1;
     }
 
-    if (mtd_partition_info(partition, &partition_size, NULL, NULL)) {
+    if (mtd_partition_info(partition, NULL, &erase_size, NULL)) {
         printf("can't get info of partition %s", partition_name);
         return -1;
     }
@@ -759,27 +1034,49 @@ int cmd_mtd_backup_raw_partition(const char *partition_name, const char *filenam
        return -1;
     }
 
+    buf = malloc(BACKUP_BATCH_BLOCKS * erase_size);
+    erased = malloc(erase_size);
     in = mtd_read_partition(partition);
-    if (in == NULL) {
-        close(fd);
-        unlink(filename);
+    if (buf == NULL || erased == NULL || in == NULL) {
         printf("error opening %s: %s\n", partition_name, strerror(errno));
-        return -1;
+        goto fail;
+    }
+    memset(erased, 0xff, erase_size);
+
+    // The backup has to know where the data ends, so this one does
+    // look at every block before reading.
+    blocks = partition->size / erase_size;
+    good = 0;
+    for (i = 0; i < blocks; ++i) {
+        if (!is_bad_block(partition, in->fd, (loff_t) i * erase_size)) ++good;
     }
 
-    total = 0;
-    while ((len = mtd_read_data(in, buf, BLOCK_SIZE)) > 0) {
-        wrote = write(fd, buf, len);
-        if (wrote != len) {
-            close(fd);
-            unlink(filename);
-            printf("error writing %s", filename);
-            return -1;
+    // Erased blocks are only written once we know more data follows
+    pending = 0;
+    while (good > 0) {
+        int want = good < BACKUP_BATCH_BLOCKS ? good : BACKUP_BATCH_BLOCKS;
+        int got = backup_read_blocks(in, buf, want);
+        int b;
+        for (b = 0; b < got; ++b) {
+            const char *block = buf + b * erase_size;
+            if (is_erased_block(block, erase_size)) {
+                pending += erase_size;
+                continue;
+            }
+            if (write_erased(fd, erased, erase_size, pending) ||
+                write(fd, block, erase_size) != (ssize_t) erase_size) {
+                printf("error writing %s", filename);
+                goto fail;
+            }
+            pending = 0;
         }
-        total += BLOCK_SIZE;
+        if (got < want) break;  // ran out of readable blocks
+        good -= got;
     }
 
     mtd_read_close(in);
+    free(buf);
+    free(erased);
 
     if (close(fd)) {
         unlink(filename);
@@ -787,6 +1084,14 @@ int cmd_mtd_backup_raw_partition(const char *partition_name, const char *filenam
         return -1;
     }
     return 0;
+
+fail:
+    if (in != NULL) mtd_read_close(in);
+    free(buf);
+    free(erased);
+    close(fd);
+    unlink(filename);
+    return -1;
 }
 
 int cmd_mtd_erase_raw_partition(const char *partition_name)
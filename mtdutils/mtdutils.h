@@ -49,15 +49,24 @@ void mtd_read_skip_to(const MtdReadContext *, size_t offset);
 
 MtdWriteContext *mtd_write_partition(const MtdPartition *);
 ssize_t mtd_write_data(MtdWriteContext *, const char *data, size_t data_len);
+ssize_t mtd_write_fd(MtdWriteContext *, int fd, ssize_t len);  /* -1 for EOF */
 off_t mtd_erase_blocks(MtdWriteContext *, int blocks);  /* 0 ok, -1 for all */
 off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos);
 int mtd_write_close(MtdWriteContext *);
 
+/* flash the image read from fd, writing its first block last so that a
+ * partial flash is never mistaken for a valid image.  Does nothing if
+ * the start of the partition already matches.
+ */
+int mtd_write_image(const MtdPartition *, int fd);
+
 struct MtdPartition {
     int device_index;
     unsigned int size;
     unsigned int erase_size;
     char *name;
+    unsigned char *bad_block_map;   /* one byte per erase block; NULL until
+                                       the first read, and after a write */
 };
 
 #endif  // MTDUTILS_H_
@@ -43,7 +43,9 @@
 #include "encryptedfs_provisioning.h"
 
 #include "extendedcommands.h"
+#include "dirscan.h"
 #include "flashutils/flashutils.h"
+#include "mmcutils/mmcutils.h"
 
 static const struct option OPTIONS[] = {
   { "send_intent", required_argument, NULL, 's' },
@@ -335,8 +337,16 @@ erase_volume(const char *volume) {
     return format_volume(volume);
 }
 
+static void
+hash_copied_data(const void* data, size_t len, void* cookie) {
+  verifier_hash_update((VerifierHash*) cookie, data, len);
+}
+
+// Copy the package to SIDELOAD_TEMP_DIR.  If hash is non-NULL, the
+// package's signed data is hashed as it is copied, so that it can be
+// verified without reading it again.
 static char*
-copy_sideloaded_package(const char* original_path) {
+copy_sideloaded_package(const char* original_path, VerifierHash* hash) {
   if (ensure_path_mounted(original_path) != 0) {
     LOGE("Can't mount %s\n", original_path);
     return NULL;
@@ -378,42 +388,40 @@ copy_sideloaded_package(const char* original_path) {
   strcpy(copy_path, SIDELOAD_TEMP_DIR);
   strcat(copy_path, "/package.zip");
 
-  char* buffer = malloc(BUFSIZ);
-  if (buffer == NULL) {
-    LOGE("Failed to allocate buffer\n");
-    return NULL;
-  }
-
-  size_t read;
-  FILE* fin = fopen(original_path, "rb");
-  if (fin == NULL) {
+  int fin = open(original_path, O_RDONLY);
+  if (fin < 0) {
     LOGE("Failed to open %s (%s)\n", original_path, strerror(errno));
     return NULL;
   }
-  FILE* fout = fopen(copy_path, "wb");
-  if (fout == NULL) {
+  int fout = open(copy_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fout < 0) {
     LOGE("Failed to open %s (%s)\n", copy_path, strerror(errno));
+    close(fin);
     return NULL;
   }
 
-  while ((read = fread(buffer, 1, BUFSIZ, fin)) > 0) {
-    if (fwrite(buffer, 1, read, fout) != read) {
-      LOGE("Short write of %s (%s)\n", copy_path, strerror(errno));
-      return NULL;
-    }
+  if (hash != NULL) {
+    // A package without a signature footer still gets copied; it
+    // will fail verification in install_package_hashed().
+    verifier_hash_init(hash, original_path);
   }
 
-  free(buffer);
-
-  if (fclose(fout) != 0) {
-    LOGE("Failed to close %s (%s)\n", copy_path, strerror(errno));
+  // Hashing needs the data in a userspace buffer; otherwise let the
+  // kernel move it.
+  if (mmc_copy_fd(fin, fout, hash != NULL ? hash_copied_data : NULL,
+                  hash) != 0) {
+    LOGE("Failed to copy %s (%s)\n", original_path, strerror(errno));
+    close(fout);
+    close(fin);
     return NULL;
   }
 
-  if (fclose(fin) != 0) {
-    LOGE("Failed to close %s (%s)\n", original_path, strerror(errno));
+  if (fsync(fout) != 0 || close(fout) != 0) {
+    LOGE("Failed to close %s (%s)\n", copy_path, strerror(errno));
+    close(fin);
     return NULL;
   }
+  close(fin);
 
   // "adb push" is happy to overwrite read-only files when it's
   // running as root, but we'll try anyway.
@@ -447,15 +455,13 @@ prepend_title(char** headers) {
     return new_headers;
 }
 
-int
-get_menu_selection(char** headers, char** items, int menu_only,
-                   int initial_selection) {
-    // throw away keys pressed previously, so user doesn't
-    // accidentally trigger menu items.
-    ui_clear_key_queue();
-
-    int item_count = ui_start_menu(headers, items, initial_selection);
-    int selected = initial_selection;
+// Runs the menu that was just started, until an item is chosen (or, if
+// wakeable, until ui_wake()).  *selection is the highlighted item, going
+// in and coming out.
+static int
+wait_menu_selection(int item_count, int menu_only, int* selection,
+                    int wakeable) {
+    int selected = *selection;
     int chosen_item = -1;
 
     // Some users with dead enter keys need a way to turn on power to select.
@@ -464,7 +470,11 @@ get_menu_selection(char** headers, char** items, int menu_only,
     int wrap_count = 0;
 
     while (chosen_item < 0 && chosen_item != GO_BACK) {
-        int key = ui_wait_key();
+        int key = wakeable ? ui_wait_key_or_wake() : ui_wait_key();
+        if (key == UI_WAKE) {
+            chosen_item = REFRESH_MENU;
+            break;
+        }
         int visible = ui_text_visible();
 
         int action = device_handle_key(key, visible);
@@ -517,13 +527,94 @@ get_menu_selection(char** headers, char** items, int menu_only,
 
     ui_end_menu();
     ui_clear_key_queue();
+    *selection = selected;
     return chosen_item;
 }
 
+int
+get_menu_selection(char** headers, char** items, int menu_only,
+                   int initial_selection) {
+    // throw away keys pressed previously, so user doesn't
+    // accidentally trigger menu items.
+    ui_clear_key_queue();
+
+    int item_count = ui_start_menu(headers, items, initial_selection);
+    return wait_menu_selection(item_count, menu_only, &initial_selection, 0);
+}
+
+int
+get_menu_selection_items(char** headers, int item_count,
+                         ui_menu_item_fn get_item, void* cookie,
+                         int menu_only, int* selection) {
+    ui_clear_key_queue();
+    item_count = ui_start_menu_items(headers, item_count, get_item, cookie,
+                                     *selection);
+    return wait_menu_selection(item_count, menu_only, selection, 1);
+}
+
 static int compare_string(const void* a, const void* b) {
     return strcmp(*(const char**)a, *(const char**)b);
 }
 
+// What sdcard_directory() shows: "../", then the zips, then the dirs.
+typedef struct {
+    DirScanList dirs;
+    DirScanList zips;
+} SdcardMenu;
+
+static const char*
+sdcard_menu_item(int index, void* cookie) {
+    SdcardMenu* menu = (SdcardMenu*) cookie;
+    if (index == 0) return "../";
+    if (--index < menu->zips.count) return menu->zips.names[index];
+    return menu->dirs.names[index - menu->zips.count];
+}
+
+static int
+sdcard_menu_filter(const char* path, const struct dirent* de, void* cookie) {
+    int name_len = strlen(de->d_name);
+
+    if (de->d_type == DT_DIR) {
+        // skip "." and ".." entries
+        if (name_len == 1 && de->d_name[0] == '.') return DIRSCAN_SKIP;
+        if (name_len == 2 && de->d_name[0] == '.' &&
+            de->d_name[1] == '.') return DIRSCAN_SKIP;
+        return DIRSCAN_DIR;
+    }
+    if (de->d_type == DT_REG &&
+        name_len >= 4 &&
+        strncasecmp(de->d_name + (name_len-4), ".zip", 4) == 0) {
+        return DIRSCAN_FILE;
+    }
+    return DIRSCAN_SKIP;
+}
+
+// Picks up what the scan found since the menu was last started, keeping
+// the highlight on the same entry.  Returns 1 once the scan is done.
+static int
+update_sdcard_menu(DirScan* scan, SdcardMenu* menu, int* selection, int wait) {
+    int count = 1 + menu->zips.count + menu->dirs.count;
+    const char* selected = *selection < count ?
+            sdcard_menu_item(*selection, menu) : NULL;
+
+    int done;
+    do {
+        done = dirscan_collect(scan, &menu->dirs, &menu->zips, wait);
+    } while (wait && !done);
+    qsort(menu->zips.names, menu->zips.count, sizeof(char*), compare_string);
+    qsort(menu->dirs.names, menu->dirs.count, sizeof(char*), compare_string);
+
+    count = 1 + menu->zips.count + menu->dirs.count;
+    *selection = count;     // the back button, if that's where it was
+    if (selected != NULL) {
+        int i;
+        for (i = 0; i < count && sdcard_menu_item(i, menu) != selected; ++i)
+            ;
+        *selection = i;
+    }
+    return done;
+}
+
 static int
 sdcard_directory(const char* path) {
     ensure_path_mounted(SDCARD_ROOT);
@@ -532,102 +623,79 @@ sdcard_directory(const char* path) {
                                    path,
                                    "",
                                    NULL };
-    DIR* d;
-    struct dirent* de;
-    d = opendir(path);
-    if (d == NULL) {
+
+    // The menu opens right away and picks up entries as the scan finds
+    // them; folders can hold thousands of files.
+    DirScan* scan = dirscan_start(path, sdcard_menu_filter, NULL);
+    if (scan == NULL) {
         LOGE("error opening %s: %s\n", path, strerror(errno));
         ensure_path_unmounted(SDCARD_ROOT);
         return 0;
     }
 
     char** headers = prepend_title(MENU_HEADERS);
-
-    int d_size = 0;
-    int d_alloc = 10;
-    char** dirs = malloc(d_alloc * sizeof(char*));
-    int z_size = 1;
-    int z_alloc = 10;
-    char** zips = malloc(z_alloc * sizeof(char*));
-    zips[0] = strdup("../");
-
-    while ((de = readdir(d)) != NULL) {
-        int name_len = strlen(de->d_name);
-
-        if (de->d_type == DT_DIR) {
-            // skip "." and ".." entries
-            if (name_len == 1 && de->d_name[0] == '.') continue;
-            if (name_len == 2 && de->d_name[0] == '.' &&
-                de->d_name[1] == '.') continue;
-
-            if (d_size >= d_alloc) {
-                d_alloc *= 2;
-                dirs = realloc(dirs, d_alloc * sizeof(char*));
-            }
-            dirs[d_size] = malloc(name_len + 2);
-            strcpy(dirs[d_size], de->d_name);
-            dirs[d_size][name_len] = '/';
-            dirs[d_size][name_len+1] = '\0';
-            ++d_size;
-        } else if (de->d_type == DT_REG &&
-                   name_len >= 4 &&
-                   strncasecmp(de->d_name + (name_len-4), ".zip", 4) == 0) {
-            if (z_size >= z_alloc) {
-                z_alloc *= 2;
-                zips = realloc(zips, z_alloc * sizeof(char*));
-            }
-            zips[z_size++] = strdup(de->d_name);
-        }
-    }
-    closedir(d);
-
-    qsort(dirs, d_size, sizeof(char*), compare_string);
-    qsort(zips, z_size, sizeof(char*), compare_string);
-
-    // append dirs to the zips list
-    if (d_size + z_size + 1 > z_alloc) {
-        z_alloc = d_size + z_size + 1;
-        zips = realloc(zips, z_alloc * sizeof(char*));
-    }
-    memcpy(zips + z_size, dirs, d_size * sizeof(char*));
-    free(dirs);
-    z_size += d_size;
-    zips[z_size] = NULL;
+    SdcardMenu menu;
+    memset(&menu, 0, sizeof(menu));
 
     int result;
-    int chosen_item = 0;
+    int selection = 0;
+    int done = update_sdcard_menu(scan, &menu, &selection, 0);
     do {
-        chosen_item = get_menu_selection(headers, zips, 1, chosen_item);
+        if (done && scan != NULL) {
+            dirscan_end(scan);
+            scan = NULL;
+        }
+        if (scan != NULL) dirscan_notify(scan, 1);
+        int chosen_item = get_menu_selection_items(headers,
+                1 + menu.zips.count + menu.dirs.count,
+                sdcard_menu_item, &menu, 1, &selection);
+        if (scan != NULL) dirscan_notify(scan, 0);
+
+        if (chosen_item == REFRESH_MENU) {
+            if (scan != NULL) {
+                done = update_sdcard_menu(scan, &menu, &selection, 0);
+            }
+            continue;
+        }
 
-        char* item = zips[chosen_item];
-        int item_len = strlen(item);
-        if (chosen_item == 0) {          // item 0 is always "../"
+        if (chosen_item == 0 || chosen_item == GO_BACK) {
+            // item 0 is always "../"
             // go up but continue browsing (if the caller is sdcard_directory)
             result = -1;
             break;
-        } else if (item[item_len-1] == '/') {
+        }
+
+        const char* item = sdcard_menu_item(chosen_item, &menu);
+        int item_len = strlen(item);
+        char new_path[PATH_MAX];
+        strlcpy(new_path, path, PATH_MAX);
+        strlcat(new_path, "/", PATH_MAX);
+        strlcat(new_path, item, PATH_MAX);
+        if (item[item_len-1] == '/') {
             // recurse down into a subdirectory
-            char new_path[PATH_MAX];
-            strlcpy(new_path, path, PATH_MAX);
-            strlcat(new_path, "/", PATH_MAX);
-            strlcat(new_path, item, PATH_MAX);
             new_path[strlen(new_path)-1] = '\0';  // truncate the trailing '/'
+            // That menu may install a zip and unmount the sdcard, which
+            // can't be done while this directory is still open.
+            if (scan != NULL) {
+                done = update_sdcard_menu(scan, &menu, &selection, 1);
+            }
             result = sdcard_directory(new_path);
             if (result >= 0) break;
         } else {
             // selected a zip file:  attempt to install it, and return
             // the status to the caller.
-            char new_path[PATH_MAX];
-            strlcpy(new_path, path, PATH_MAX);
-            strlcat(new_path, "/", PATH_MAX);
-            strlcat(new_path, item, PATH_MAX);
-
+            if (scan != NULL) {
+                dirscan_end(scan);
+                scan = NULL;
+            }
             ui_print("\n-- Install %s ...\n", path);
             set_sdcard_update_bootloader_message();
-            char* copy = copy_sideloaded_package(new_path);
+            VerifierHash hash;
+            VerifierHash* phash = signature_check_enabled ? &hash : NULL;
+            char* copy = copy_sideloaded_package(new_path, phash);
             ensure_path_unmounted(SDCARD_ROOT);
             if (copy) {
-                result = install_package(copy);
+                result = install_package_hashed(copy, phash);
                 free(copy);
             } else {
                 result = INSTALL_ERROR;
@@ -636,9 +704,9 @@ sdcard_directory(const char* path) {
         }
     } while (true);
 
-    int i;
-    for (i = 0; i < z_size; ++i) free(zips[i]);
-    free(zips);
+    if (scan != NULL) dirscan_end(scan);
+    dirscan_free_list(&menu.dirs);
+    dirscan_free_list(&menu.zips);
     free(headers);
 
     ensure_path_unmounted(SDCARD_ROOT);
@@ -942,6 +1010,7 @@ main(int argc, char **argv) {
         ui_print("重启手机...\n");
     else
         ui_print("关闭手机...\n");
+    ui_flush();
     sync();
     reboot((!poweroff) ? RB_AUTOBOOT : RB_POWER_OFF);
     return EXIT_SUCCESS;
@@ -17,6 +17,8 @@
 #ifndef _RECOVERY_UI_H
 #define _RECOVERY_UI_H
 
+#include "common.h"  // for ui_menu_item_fn
+
 // Called when recovery starts up.  Returns 0.
 extern int device_recovery_start();
 
@@ -85,6 +87,17 @@ extern char* MENU_ITEMS[];
 int
 get_menu_selection(char** headers, char** items, int menu_only, int initial_selection);
 
+// Same, with the items fetched through get_item() as in ui_start_menu_items().
+// *selection is the item to highlight first, and is set to the highlighted
+// item on return.  Also returns REFRESH_MENU if ui_wake() is called, so the
+// caller can pick up new items and start the menu again.
+#define REFRESH_MENU        -6
+
+int
+get_menu_selection_items(char** headers, int item_count,
+                         ui_menu_item_fn get_item, void* cookie,
+                         int menu_only, int* selection);
+
 void
 set_sdcard_update_bootloader_message();
 
@@ -15,7 +15,11 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -31,6 +35,16 @@
 int num_volumes;
 Volume* device_volumes;
 
+// Mount points longest first, so the first prefix match in
+// volume_for_path() is the most specific volume.
+typedef struct {
+    const char* mount_point;
+    int len;
+    Volume* volume;
+} VolumeIndex;
+
+static VolumeIndex* volume_index;
+
 int get_num_volumes() {
     return num_volumes;
 }
@@ -53,6 +67,24 @@ static char* dupe_string(const char* sz) {
     return strdup(sz);
 }
 
+static void build_volume_index() {
+    int i, j;
+    free(volume_index);
+    volume_index = malloc(num_volumes * sizeof(VolumeIndex));
+    if (volume_index == NULL)
+        return;
+    for (i = 0; i < num_volumes; ++i) {
+        VolumeIndex entry;
+        entry.mount_point = device_volumes[i].mount_point;
+        entry.len = strlen(entry.mount_point);
+        entry.volume = &device_volumes[i];
+        // insertion sort keeps fstab order among equal lengths
+        for (j = i; j > 0 && volume_index[j-1].len < entry.len; --j)
+            volume_index[j] = volume_index[j-1];
+        volume_index[j] = entry;
+    }
+}
+
 void load_volume_table() {
     int alloc = 2;
     device_volumes = malloc(alloc * sizeof(Volume));
@@ -69,6 +101,7 @@ void load_volume_table() {
     FILE* fstab = fopen("/etc/recovery.fstab", "r");
     if (fstab == NULL) {
         LOGE("failed to open /etc/recovery.fstab (%s)\n", strerror(errno));
+        build_volume_index();
         return;
     }
 
@@ -118,6 +151,7 @@ void load_volume_table() {
     }
 
     fclose(fstab);
+    build_volume_index();
 
     printf("recovery filesystem table\n");
     printf("=========================\n");
@@ -131,33 +165,221 @@ void load_volume_table() {
 
 Volume* volume_for_path(const char* path) {
     int i;
+    if (volume_index == NULL)
+        return NULL;
+    int path_len = strlen(path);
     for (i = 0; i < num_volumes; ++i) {
-        Volume* v = device_volumes+i;
-        int len = strlen(v->mount_point);
-        if (strncmp(path, v->mount_point, len) == 0 &&
-            (path[len] == '\0' || path[len] == '/')) {
-            return v;
+        const VolumeIndex* e = &volume_index[i];
+        int len = e->len;
+        if (len <= path_len &&
+            (path[len] == '\0' || path[len] == '/') &&
+            memcmp(path, e->mount_point, len) == 0) {
+            return e->volume;
         }
     }
     return NULL;
 }
 
+// Not every libc has the newer flags.
+#ifndef MS_RELATIME
+#define MS_RELATIME     (1 << 21)
+#endif
+#ifndef MS_STRICTATIME
+#define MS_STRICTATIME  (1 << 24)
+#endif
+#ifndef MS_UNBINDABLE
+#define MS_UNBINDABLE   (1 << 17)
+#endif
+#ifndef MS_PRIVATE
+#define MS_PRIVATE      (1 << 18)
+#endif
+#ifndef MS_SLAVE
+#define MS_SLAVE        (1 << 19)
+#endif
+#ifndef MS_SHARED
+#define MS_SHARED       (1 << 20)
+#endif
+
+// Changing propagation is a mount(2) call of its own, made after the
+// filesystem is mounted.
+#define MS_PROPAGATION  (MS_UNBINDABLE | MS_PRIVATE | MS_SLAVE | MS_SHARED)
+
+// Options that turn into mount(2) flags.  Those with neither set nor
+// clear are for mount(8) itself (or fstab readers like it) and are
+// dropped rather than passed on to the filesystem, which would reject
+// them.  "loop" is one of those: we don't set up loop devices.
+static const struct {
+    const char* name;
+    unsigned long set;
+    unsigned long clear;
+} mount_flags[] = {
+    { "defaults",   0,              0 },
+    { "auto",       0,              0 },
+    { "noauto",     0,              0 },
+    { "user",       0,              0 },
+    { "nouser",     0,              0 },
+    { "users",      0,              0 },
+    { "owner",      0,              0 },
+    { "group",      0,              0 },
+    { "loop",       0,              0 },
+    { "nofail",     0,              0 },
+    { "_netdev",    0,              0 },
+    { "ro",         MS_RDONLY,      0 },
+    { "rw",         0,              MS_RDONLY },
+    { "nosuid",     MS_NOSUID,      0 },
+    { "suid",       0,              MS_NOSUID },
+    { "nodev",      MS_NODEV,       0 },
+    { "dev",        0,              MS_NODEV },
+    { "noexec",     MS_NOEXEC,      0 },
+    { "exec",       0,              MS_NOEXEC },
+    { "sync",       MS_SYNCHRONOUS, 0 },
+    { "async",      0,              MS_SYNCHRONOUS },
+    { "remount",    MS_REMOUNT,     0 },
+    { "bind",       MS_BIND,        0 },
+    { "noatime",    MS_NOATIME,     0 },
+    { "atime",      0,              MS_NOATIME },
+    { "nodiratime", MS_NODIRATIME,  0 },
+    { "diratime",   0,              MS_NODIRATIME },
+    { "relatime",   MS_RELATIME,    MS_NOATIME | MS_STRICTATIME },
+    { "norelatime", 0,              MS_RELATIME },
+    { "strictatime", MS_STRICTATIME, MS_NOATIME | MS_RELATIME },
+    { "nostrictatime", 0,           MS_STRICTATIME },
+    { "dirsync",    MS_DIRSYNC,     0 },
+    { "mand",       MS_MANDLOCK,    0 },
+    { "nomand",     0,              MS_MANDLOCK },
+    { "rbind",      MS_BIND | MS_REC, 0 },
+    { "move",       MS_MOVE,        0 },
+    { "shared",     MS_SHARED,      MS_PROPAGATION & ~MS_SHARED },
+    { "private",    MS_PRIVATE,     MS_PROPAGATION & ~MS_PRIVATE },
+    { "slave",      MS_SLAVE,       MS_PROPAGATION & ~MS_SLAVE },
+    { "unbindable", MS_UNBINDABLE,  MS_PROPAGATION & ~MS_UNBINDABLE },
+    { NULL,         0,              0 },
+};
+
+// Split an fstab style option string into mount(2) flags and the
+// comma separated options the filesystem itself has to parse.  Returns
+// -1 if out of memory.
+static int parse_mount_options(const char* options, unsigned long* flags,
+                               char* data, size_t data_len) {
+    char* copy = strdup(options);
+    char* save;
+    char* opt;
+    size_t used = 0;
+
+    *flags = 0;
+    data[0] = '\0';
+    if (copy == NULL) {
+        LOGE("out of memory parsing mount options\n");
+        return -1;
+    }
+    for (opt = strtok_r(copy, ",", &save); opt != NULL;
+         opt = strtok_r(NULL, ",", &save)) {
+        int i;
+        // more options for mount(8) only
+        if (strncmp(opt, "x-", 2) == 0 || strncmp(opt, "comment=", 8) == 0)
+            continue;
+        for (i = 0; mount_flags[i].name != NULL; ++i) {
+            if (strcmp(opt, mount_flags[i].name) == 0) {
+                *flags = (*flags | mount_flags[i].set) & ~mount_flags[i].clear;
+                break;
+            }
+        }
+        if (mount_flags[i].name == NULL) {
+            size_t n = snprintf(data + used, data_len - used, "%s%s",
+                                used ? "," : "", opt);
+            if (used + n >= data_len) {
+                LOGW("mount options too long: %s\n", options);
+                data[used] = '\0';
+                break;
+            }
+            used += n;
+        }
+    }
+    free(copy);
+    return 0;
+}
+
+#define EXT_SUPERBLOCK_OFFSET   1024
+#define EXT_MAGIC_OFFSET        0x38
+#define EXT_MAGIC               0xEF53
+#define EXT_FEATURE_COMPAT      0x5C
+#define EXT_FEATURE_INCOMPAT    0x60
+#define EXT_FEATURE_RO_COMPAT   0x64
+#define EXT3_HAS_JOURNAL        0x0004
+#define EXT4_INCOMPAT_MASK      0x02C0  // extents, 64bit, flex_bg
+#define EXT4_RO_COMPAT_MASK     0x0078  // huge_file, gdt_csum, dir_nlink, extra_isize
+
+static unsigned le16(const unsigned char* p) {
+    return p[0] | p[1] << 8;
+}
+
+static unsigned le32(const unsigned char* p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned) p[3] << 24;
+}
+
+// Identify the filesystem on a device by its superblock, for fstab
+// entries whose type we can't hand to mount(2) as is.
+static const char* detect_fs_type(const char* device) {
+    unsigned char buf[EXT_SUPERBLOCK_OFFSET + 1024];
+    int fd = open(device, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    ssize_t len = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (len != (ssize_t) sizeof(buf))
+        return NULL;
+
+    const unsigned char* sb = buf + EXT_SUPERBLOCK_OFFSET;
+    if (le16(sb + EXT_MAGIC_OFFSET) == EXT_MAGIC) {
+        if ((le32(sb + EXT_FEATURE_INCOMPAT) & EXT4_INCOMPAT_MASK) ||
+            (le32(sb + EXT_FEATURE_RO_COMPAT) & EXT4_RO_COMPAT_MASK))
+            return "ext4";
+        if (le32(sb + EXT_FEATURE_COMPAT) & EXT3_HAS_JOURNAL)
+            return "ext3";
+        return "ext2";
+    }
+
+    // FAT boot sector: the type string is at 0x36 (FAT12/16) or 0x52 (FAT32)
+    if (buf[510] == 0x55 && buf[511] == 0xAA &&
+        (memcmp(buf + 0x36, "FAT", 3) == 0 || memcmp(buf + 0x52, "FAT32", 5) == 0))
+        return "vfat";
+
+    return NULL;
+}
+
 int try_mount(const char* device, const char* mount_point, const char* fs_type, const char* fs_options) {
     if (device == NULL || mount_point == NULL || fs_type == NULL)
         return -1;
+    if (strcmp(fs_type, "auto") == 0) {
+        fs_type = detect_fs_type(device);
+        if (fs_type == NULL) {
+            LOGW("can't tell the filesystem on %s\n", device);
+            return -1;
+        }
+    }
     int ret = 0;
     if (fs_options == NULL) {
         ret = mount(device, mount_point, fs_type,
                        MS_NOATIME | MS_NODEV | MS_NODIRATIME, "");
     }
     else {
-        char mount_cmd[PATH_MAX];
-        sprintf(mount_cmd, "mount -t %s -o%s %s %s", fs_type, fs_options, device, mount_point);
-        LOGE("%s\n", mount_cmd);
-        ret = __system(mount_cmd);
+        unsigned long flags;
+        char data[PATH_MAX];
+        if (parse_mount_options(fs_options, &flags, data, sizeof(data)) < 0)
+            return -1;
+        unsigned long propagation = flags & MS_PROPAGATION;
+        ret = mount(device, mount_point, fs_type, flags & ~MS_PROPAGATION,
+                    data);
+        if (ret == 0 && propagation &&
+            mount(NULL, mount_point, NULL, propagation, NULL) < 0) {
+            LOGW("can't change propagation of %s (%s)\n", mount_point,
+                 strerror(errno));
+        }
     }
-    if (ret == 0)
+    if (ret == 0) {
+        invalidate_mounted_volumes();
         return 0;
+    }
     LOGW("failed to mount %s (%s)\n", device, strerror(errno));
     return ret;
 }
@@ -199,6 +421,7 @@ int ensure_path_mounted(const char* path) {
                  v->device, v->mount_point);
             return -1;
         }
+        invalidate_mounted_volumes();
         return mtd_mount_partition(partition, v->mount_point, v->fs_type, 0);
     } else if (strcmp(v->fs_type, "ext4") == 0 ||
                strcmp(v->fs_type, "ext3") == 0 ||
@@ -214,9 +437,15 @@ int ensure_path_mounted(const char* path) {
             return 0;
         return result;
     } else {
-        // let's try mounting with the mount binary and hope for the best.
+        // Find out what's really on the device; failing that, try the
+        // mount binary and hope for the best.
+        const char* detected = v->device[0] == '/' ? detect_fs_type(v->device) : NULL;
+        if (detected != NULL &&
+            try_mount(v->device, v->mount_point, detected, v->fs_options) == 0)
+            return 0;
         char mount_cmd[PATH_MAX];
         sprintf(mount_cmd, "mount %s", path);
+        invalidate_mounted_volumes();
         return __system(mount_cmd);
     }
 
@@ -252,6 +481,31 @@ int ensure_path_unmounted(const char* path) {
     return unmount_mounted_volume(mv);
 }
 
+#ifndef BLKGETSIZE64
+#define BLKGETSIZE64 _IOR(0x12,114,size_t)
+#endif
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12,119)
+#endif
+
+int discard_block_device(const char *device)
+{
+    int fd = open(device, O_WRONLY);
+    if (fd < 0)
+        return -1;
+
+    uint64_t range[2] = { 0, 0 };
+    int ret = ioctl(fd, BLKGETSIZE64, &range[1]);
+    if (ret == 0) {
+        // Plain discard: BLKSECDISCARD physically erases and is much slower.
+        ret = ioctl(fd, BLKDISCARD, range);
+        if (ret == 0)
+            LOGI("Discarded %llu bytes on %s.\n", range[1], device);
+    }
+    close(fd);
+    return ret;
+}
+
 int format_volume(const char* volume) {
     Volume* v = volume_for_path(volume);
     if (v == NULL) {
@@ -307,6 +561,9 @@ int format_volume(const char* volume) {
     }
 
     if (strcmp(v->fs_type, "ext4") == 0) {
+        // Throw away the old contents wholesale, so make_ext4fs only
+        // has to lay down fresh metadata.
+        discard_block_device(v->device);
         reset_ext4fs_info();
         int result = make_ext4fs(v->device, NULL, NULL, 0, 0, 0);
         if (result != 0) {
@@ -25,6 +25,11 @@ void load_volume_table();
 // Return the Volume* record for this path (or NULL).
 Volume* volume_for_path(const char* path);
 
+// Mount device on mount_point with mount(2).  fs_options is an fstab
+// style option string (or NULL for the defaults); fs_type may be "auto"
+// to go by the device's superblock.  Returns 0 on success.
+int try_mount(const char* device, const char* mount_point, const char* fs_type, const char* fs_options);
+
 // Make sure that the volume 'path' is on is mounted.  Returns 0 on
 // success (volume is mounted).
 int ensure_path_mounted(const char* path);
@@ -38,6 +43,9 @@ int ensure_path_unmounted(const char* path);
 // it is mounted.
 int format_volume(const char* volume);
 
+// Tell the device every block is free (BLKDISCARD); -1 if unsupported.
+int discard_block_device(const char* device);
+
 int get_num_volumes();
 
 Volume* get_device_volumes();
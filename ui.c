@@ -38,9 +38,6 @@ static int gShowBackButton = 0;
 #define MAX_COLS 96
 #define MAX_ROWS 32
 
-#define MENU_MAX_COLS 64
-#define MENU_MAX_ROWS 250
-
 #ifndef BOARD_LDPI_RECOVERY
   #define CHAR_WIDTH 10
   #define CHAR_HEIGHT 18
@@ -52,7 +49,13 @@ static int gShowBackButton = 0;
 #define PROGRESSBAR_INDETERMINATE_STATES 6
 #define PROGRESSBAR_INDETERMINATE_FPS 15
 
+// Most frames per second spent on log text and progress updates
+#define UI_UPDATE_FPS 30
+#define PENDING_TEXT_SIZE 8192
+
 static pthread_mutex_t gUpdateMutex = PTHREAD_MUTEX_INITIALIZER;
+// Wakes progress_thread when there may be progress to animate
+static pthread_cond_t gProgressCond = PTHREAD_COND_INITIALIZER;
 static gr_surface gBackgroundIcon[NUM_BACKGROUND_ICONS];
 static gr_surface gProgressBarIndeterminate[PROGRESSBAR_INDETERMINATE_STATES];
 static gr_surface gProgressBarEmpty;
@@ -86,7 +89,8 @@ static enum ProgressBarType {
 static float gProgressScopeStart = 0, gProgressScopeSize = 0, gProgress = 0;
 static time_t gProgressScopeTime, gProgressScopeDuration;
 
-// Set to 1 when both graphics pages are the same (except for the progress bar)
+// Set to 1 when the drawing surface holds exactly what's on the screen, so
+// parts of it can be redrawn and flipped on their own.
 static int gPagesIdentical = 0;
 
 // Log text overlay, displayed when a magic key is pressed
@@ -95,22 +99,43 @@ static int text_cols = 0, text_rows = 0;
 static int text_col = 0, text_row = 0, text_top = 0;
 static int show_text = 0;
 
-static char menu[MENU_MAX_ROWS][MENU_MAX_COLS];
+static char menu[MAX_ROWS][MAX_COLS];       // the header lines
 static int show_menu = 0;
 static int menu_top = 0, menu_items = 0, menu_sel = 0;
 static int menu_show_start = 0;             // this is line which menu display is starting at 
+// Items are only fetched as their rows are drawn, so a menu can be any
+// length without copying it.  The back button, if any, is the last item.
+static ui_menu_item_fn menu_get_item = NULL;
+static void *menu_cookie = NULL;
+static int menu_back_button = 0;
+
+// Log text and progress handed over by ui_print() and ui_set_progress(),
+// which the render thread folds into a frame at most UI_UPDATE_FPS times
+// a second.  Callers only ever hold gPendingMutex briefly, never while
+// drawing.  '\r' in the text stands for ui_reset_text_col().
+static pthread_mutex_t gPendingMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gPendingCond = PTHREAD_COND_INITIALIZER;
+static char gPendingText[PENDING_TEXT_SIZE];
+static int gPendingLen = 0;
+static float gPendingProgress = -1;         // < 0 if nothing new
+// For ui_flush(): set while the render thread draws what it took, and
+// broadcast on gFlushedCond once it's on screen.
+static pthread_cond_t gFlushedCond = PTHREAD_COND_INITIALIZER;
+static int gRenderBusy = 0;
+static int gFlushWaiters = 0;
+static int gRenderStarted = 0;
 
 // Key event input queue
 static pthread_mutex_t key_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t key_queue_cond = PTHREAD_COND_INITIALIZER;
 static int key_queue[256], key_queue_len = 0;
+static int key_wake = 0;
 static volatile char key_pressed[KEY_MAX + 1];
 
 // Clear the screen and draw the currently selected background icon (if any).
 // Should only be called with gUpdateMutex locked.
 static void draw_background_locked(gr_surface icon)
 {
-    gPagesIdentical = 0;
     gr_color(0, 0, 0, 255);
     gr_fill(0, 0, gr_fb_width(), gr_fb_height());
 
@@ -123,18 +148,25 @@ static void draw_background_locked(gr_surface icon)
     }
 }
 
+// Where the progress bar goes on the screen.
+static void get_progress_rect(int* dx, int* dy, int* width, int* height)
+{
+    int iconHeight = gr_get_height(gBackgroundIcon[BACKGROUND_ICON_INSTALLING]);
+    *width = gr_get_width(gProgressBarEmpty);
+    *height = gr_get_height(gProgressBarEmpty);
+
+    *dx = (gr_fb_width() - *width)/2;
+    *dy = (3*gr_fb_height() + iconHeight - 2 * *height)/4;
+}
+
 // Draw the progress bar (if any) on the screen.  Does not flip pages.
 // Should only be called with gUpdateMutex locked.
 static void draw_progress_locked()
 {
     if (gProgressBarType == PROGRESSBAR_TYPE_NONE) return;
 
-    int iconHeight = gr_get_height(gBackgroundIcon[BACKGROUND_ICON_INSTALLING]);
-    int width = gr_get_width(gProgressBarEmpty);
-    int height = gr_get_height(gProgressBarEmpty);
-
-    int dx = (gr_fb_width() - width)/2;
-    int dy = (3*gr_fb_height() + iconHeight - 2*height)/4;
+    int dx, dy, width, height;
+    get_progress_rect(&dx, &dy, &width, &height);
 
     // Erase behind the progress bar (in case this was a progress-only update)
     gr_color(0, 0, 0, 255);
@@ -165,6 +197,20 @@ static void draw_text_line(int row, const char* t) {
   }
 }
 
+#define MENU_ITEM_HEADER " - "
+
+static void draw_menu_item(int row, int item) {
+    char line[MAX_COLS];
+    const char *t;
+    if (menu_back_button && item == menu_items - 1) {
+        t = "---返回---";
+    } else {
+        t = menu_get_item(item, menu_cookie);
+    }
+    snprintf(line, text_cols, MENU_ITEM_HEADER "%s", t ? t : "");
+    draw_text_line(row, line);
+}
+
 #define MENU_TEXT_COLOR 255, 160, 49, 255
 #define NORMAL_TEXT_COLOR 200, 200, 200, 255
 #define HEADER_TEXT_COLOR NORMAL_TEXT_COLOR
@@ -204,11 +250,11 @@ static void draw_screen_locked(void)
             for (i = menu_show_start + menu_top; i < (menu_show_start + menu_top + j); ++i) {
                 if (i == menu_top + menu_sel) {
                     gr_color(255, 255, 255, 255);
-                    draw_text_line(i - menu_show_start , menu[i]);
+                    draw_menu_item(i - menu_show_start, i - menu_top);
                     gr_color(MENU_TEXT_COLOR);
                 } else {
                     gr_color(MENU_TEXT_COLOR);
-                    draw_text_line(i - menu_show_start, menu[i]);
+                    draw_menu_item(i - menu_show_start, i - menu_top);
                 }
                 row++;
             }
@@ -230,6 +276,32 @@ static void update_screen_locked(void)
     if (!ui_has_initialized) return;
     draw_screen_locked();
     gr_flip();
+    gPagesIdentical = 1;
+}
+
+// Redraw and flip just a part of the screen, falling back to the whole
+// thing if the drawing surface is out of date.
+// Should only be called with gUpdateMutex locked.
+static void update_screen_rect_locked(int x, int y, int w, int h)
+{
+    if (!ui_has_initialized) return;
+    if (!gPagesIdentical) {
+        update_screen_locked();
+        return;
+    }
+    gr_set_clip(x, y, w, h);
+    draw_screen_locked();
+    gr_clear_clip();
+    gr_flip_region(x, y, w, h);
+}
+
+// Redraw the screen rows first..last (inclusive).
+// Should only be called with gUpdateMutex locked.
+static void update_rows_locked(int first, int last)
+{
+    // glyphs and the menu highlight reach one pixel into the next row
+    update_screen_rect_locked(0, first * CHAR_HEIGHT, gr_fb_width(),
+                              (last - first + 1) * CHAR_HEIGHT + 1);
 }
 
 // Updates only the progress bar, if possible, otherwise redraws the screen.
@@ -237,41 +309,180 @@ static void update_screen_locked(void)
 static void update_progress_locked(void)
 {
     if (!ui_has_initialized) return;
-    if (show_text || !gPagesIdentical) {
-        draw_screen_locked();    // Must redraw the whole screen
-        gPagesIdentical = 1;
+    int dx, dy, width, height;
+    get_progress_rect(&dx, &dy, &width, &height);
+    if (show_text) {
+        // The bar is under the text overlay; redraw everything over it
+        update_screen_rect_locked(dx, dy, width, height);
+    } else if (!gPagesIdentical) {
+        update_screen_locked();
     } else {
         draw_progress_locked();  // Draw only the progress bar
+        gr_flip_region(dx, dy, width, height);
     }
-    gr_flip();
 }
 
-// Keeps the progress bar updated, even when the process is otherwise busy.
+// Whether progress_thread has anything to move along.
+// Should only be called with gUpdateMutex locked.
+static int progress_animating_locked()
+{
+    // skip the animation if we have a text overlay (too expensive to update)
+    if (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE) return !show_text;
+    return gProgressBarType == PROGRESSBAR_TYPE_NORMAL &&
+           gProgressScopeDuration > 0 && gProgress < 1.0;
+}
+
+// Keeps the progress bar moving.  Sleeps on gProgressCond while there's
+// nothing to animate, and otherwise only until the next frame is due.
 static void *progress_thread(void *cookie)
 {
-    for (;;) {
-        usleep(1000000 / PROGRESSBAR_INDETERMINATE_FPS);
-        pthread_mutex_lock(&gUpdateMutex);
+    const long frame_ns = 1000000000L / PROGRESSBAR_INDETERMINATE_FPS;
+    struct timespec now, next_frame, deadline;
 
-        // update the progress bar animation, if active
-        // skip this if we have a text overlay (too expensive to update)
-        if (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE && !show_text) {
-            update_progress_locked();
+    pthread_mutex_lock(&gUpdateMutex);
+    for (;;) {
+        if (!progress_animating_locked()) {
+            do {
+                pthread_cond_wait(&gProgressCond, &gUpdateMutex);
+            } while (!progress_animating_locked());
+            // whoever woke us has just drawn the bar
+            clock_gettime(CLOCK_REALTIME, &next_frame);
+            next_frame.tv_nsec += frame_ns;
+            if (next_frame.tv_nsec >= 1000000000L) {
+                next_frame.tv_nsec -= 1000000000L;
+                next_frame.tv_sec++;
+            }
         }
 
-        // move the progress bar forward on timed intervals, if configured
-        int duration = gProgressScopeDuration;
-        if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL && duration > 0) {
-            int elapsed = time(NULL) - gProgressScopeTime;
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE) {
+            // update the progress bar animation
+            if (now.tv_sec > next_frame.tv_sec ||
+                (now.tv_sec == next_frame.tv_sec &&
+                 now.tv_nsec >= next_frame.tv_nsec)) {
+                update_progress_locked();
+                next_frame = now;
+                next_frame.tv_nsec += frame_ns;
+                if (next_frame.tv_nsec >= 1000000000L) {
+                    next_frame.tv_nsec -= 1000000000L;
+                    next_frame.tv_sec++;
+                }
+            }
+            deadline = next_frame;
+        } else {
+            // move the progress bar forward on timed intervals; it only
+            // changes when another whole second has passed
+            int duration = gProgressScopeDuration;
+            int elapsed = now.tv_sec - gProgressScopeTime;
             float progress = 1.0 * elapsed / duration;
             if (progress > 1.0) progress = 1.0;
             if (progress > gProgress) {
                 gProgress = progress;
                 update_progress_locked();
             }
+            deadline.tv_sec = gProgressScopeTime + elapsed + 1;
+            deadline.tv_nsec = 0;
+        }
+
+        pthread_cond_timedwait(&gProgressCond, &gUpdateMutex, &deadline);
+    }
+    return NULL;
+}
+
+// Adds text to the log, and redraws whatever part of it is visible.
+// Should only be called with gUpdateMutex locked.
+static void print_text_locked(const char* buf, int len)
+{
+    if (text_rows <= 0 || text_cols <= 0) return;
+
+    int old_top = text_top, first_row = text_row;
+    const char *ptr;
+    for (ptr = buf; ptr < buf + len; ++ptr) {
+        if (*ptr == '\r') {
+            text_col = 0;
+            continue;
+        }
+        if (*ptr == '\n' || text_col >= text_cols) {
+            text[text_row][text_col] = '\0';
+            text_col = 0;
+            text_row = (text_row + 1) % text_rows;
+            if (text_row == text_top) text_top = (text_top + 1) % text_rows;
+        }
+        if (*ptr != '\n') text[text_row][text_col++] = *ptr;
+    }
+    text[text_row][text_col] = '\0';
+
+    if (!show_text) {
+        // the log isn't on screen, nothing to redraw
+    } else if (text_top != old_top) {
+        update_screen_locked();  // everything scrolled
+    } else {
+        // screen row r shows text[(r + text_top) % text_rows]
+        update_rows_locked((first_row - text_top + text_rows) % text_rows,
+                           (text_row - text_top + text_rows) % text_rows);
+    }
+}
+
+// Should only be called with gUpdateMutex locked.
+static void set_progress_locked(float fraction)
+{
+    if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL && fraction > gProgress) {
+        // Skip updates that aren't visibly different.
+        int width = gr_get_width(gProgressBarIndeterminate[0]);
+        float scale = width * gProgressScopeSize;
+        if ((int) (gProgress * scale) != (int) (fraction * scale)) {
+            gProgress = fraction;
+            update_progress_locked();
         }
+    }
+}
 
+// Puts pending log text and progress on the screen, coalescing whatever
+// arrives within a frame, so busy callers never wait for drawing.
+static void *render_thread(void *cookie)
+{
+    static char buf[PENDING_TEXT_SIZE];
+    const long frame_us = 1000000 / UI_UPDATE_FPS;
+    struct timeval last = { 0, 0 };
+
+    for (;;) {
+        pthread_mutex_lock(&gPendingMutex);
+        while (gPendingLen == 0 && gPendingProgress < 0) {
+            pthread_cond_wait(&gPendingCond, &gPendingMutex);
+        }
+        int flushing = gFlushWaiters > 0;
+        pthread_mutex_unlock(&gPendingMutex);
+
+        // Let more updates pile up until the next frame is due, unless
+        // someone is waiting for them in ui_flush()
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        long elapsed = (now.tv_sec - last.tv_sec) * 1000000 +
+                       (now.tv_usec - last.tv_usec);
+        if (!flushing && elapsed >= 0 && elapsed < frame_us) {
+            usleep(frame_us - elapsed);
+        }
+
+        pthread_mutex_lock(&gPendingMutex);
+        int len = gPendingLen;
+        memcpy(buf, gPendingText, len);
+        gPendingLen = 0;
+        float progress = gPendingProgress;
+        gPendingProgress = -1;
+        gRenderBusy = 1;
+        pthread_mutex_unlock(&gPendingMutex);
+
+        pthread_mutex_lock(&gUpdateMutex);
+        if (len > 0) print_text_locked(buf, len);
+        if (progress >= 0) set_progress_locked(progress);
         pthread_mutex_unlock(&gUpdateMutex);
+
+        pthread_mutex_lock(&gPendingMutex);
+        gRenderBusy = 0;
+        pthread_cond_broadcast(&gFlushedCond);
+        pthread_mutex_unlock(&gPendingMutex);
+
+        gettimeofday(&last, NULL);
     }
     return NULL;
 }
@@ -334,6 +545,7 @@ static void *input_thread(void *cookie)
             pthread_mutex_lock(&gUpdateMutex);
             show_text = !show_text;
             update_screen_locked();
+            pthread_cond_signal(&gProgressCond);
             pthread_mutex_unlock(&gUpdateMutex);
         }
 
@@ -373,16 +585,21 @@ void ui_init(void)
 
     pthread_t t;
     pthread_create(&t, NULL, progress_thread, NULL);
+    pthread_create(&t, NULL, render_thread, NULL);
+    pthread_mutex_lock(&gPendingMutex);
+    gRenderStarted = 1;
+    pthread_mutex_unlock(&gPendingMutex);
     pthread_create(&t, NULL, input_thread, NULL);
 }
 
 char *ui_copy_image(int icon, int *width, int *height, int *bpp) {
     pthread_mutex_lock(&gUpdateMutex);
     draw_background_locked(gBackgroundIcon[icon]);
+    gPagesIdentical = 0;
     *width = gr_fb_width();
     *height = gr_fb_height();
-    *bpp = sizeof(gr_pixel) * 8;
-    int size = *width * *height * sizeof(gr_pixel);
+    *bpp = gr_fb_bpp();
+    int size = *width * *height * (*bpp / 8);
     char *ret = malloc(size);
     if (ret == NULL) {
         LOGE("Can't allocate %d bytes for image\n", size);
@@ -395,6 +612,7 @@ char *ui_copy_image(int icon, int *width, int *height, int *bpp) {
 
 void ui_set_background(int icon)
 {
+    ui_flush();
     pthread_mutex_lock(&gUpdateMutex);
     gCurrentIcon = gBackgroundIcon[icon];
     update_screen_locked();
@@ -407,6 +625,7 @@ void ui_show_indeterminate_progress()
     if (gProgressBarType != PROGRESSBAR_TYPE_INDETERMINATE) {
         gProgressBarType = PROGRESSBAR_TYPE_INDETERMINATE;
         update_progress_locked();
+        pthread_cond_signal(&gProgressCond);
     }
     pthread_mutex_unlock(&gUpdateMutex);
 }
@@ -414,6 +633,9 @@ void ui_show_indeterminate_progress()
 void ui_show_progress(float portion, int seconds)
 {
     pthread_mutex_lock(&gUpdateMutex);
+    pthread_mutex_lock(&gPendingMutex);
+    gPendingProgress = -1;  // belongs to the previous scope
+    pthread_mutex_unlock(&gPendingMutex);
     gProgressBarType = PROGRESSBAR_TYPE_NORMAL;
     gProgressScopeStart += gProgressScopeSize;
     gProgressScopeSize = portion;
@@ -421,29 +643,26 @@ void ui_show_progress(float portion, int seconds)
     gProgressScopeDuration = seconds;
     gProgress = 0;
     update_progress_locked();
+    pthread_cond_signal(&gProgressCond);
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
 void ui_set_progress(float fraction)
 {
-    pthread_mutex_lock(&gUpdateMutex);
     if (fraction < 0.0) fraction = 0.0;
     if (fraction > 1.0) fraction = 1.0;
-    if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL && fraction > gProgress) {
-        // Skip updates that aren't visibly different.
-        int width = gr_get_width(gProgressBarIndeterminate[0]);
-        float scale = width * gProgressScopeSize;
-        if ((int) (gProgress * scale) != (int) (fraction * scale)) {
-            gProgress = fraction;
-            update_progress_locked();
-        }
-    }
-    pthread_mutex_unlock(&gUpdateMutex);
+    pthread_mutex_lock(&gPendingMutex);
+    gPendingProgress = fraction;
+    pthread_cond_signal(&gPendingCond);
+    pthread_mutex_unlock(&gPendingMutex);
 }
 
 void ui_reset_progress()
 {
     pthread_mutex_lock(&gUpdateMutex);
+    pthread_mutex_lock(&gPendingMutex);
+    gPendingProgress = -1;
+    pthread_mutex_unlock(&gPendingMutex);
     gProgressBarType = PROGRESSBAR_TYPE_NONE;
     gProgressScopeStart = gProgressScopeSize = 0;
     gProgressScopeTime = gProgressScopeDuration = 0;
@@ -452,6 +671,24 @@ void ui_reset_progress()
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
+// Hand text to the render thread.
+static void queue_text(const char *buf, int len)
+{
+    pthread_mutex_lock(&gPendingMutex);
+    if (gPendingLen + len > PENDING_TEXT_SIZE) {
+        // Only the last screenful is ever visible; forget older lines.
+        int drop = gPendingLen + len - PENDING_TEXT_SIZE / 2;
+        char *nl = memchr(gPendingText + drop, '\n', gPendingLen - drop);
+        if (nl != NULL) drop = nl + 1 - gPendingText;
+        memmove(gPendingText, gPendingText + drop, gPendingLen - drop);
+        gPendingLen -= drop;
+    }
+    memcpy(gPendingText + gPendingLen, buf, len);
+    gPendingLen += len;
+    pthread_cond_signal(&gPendingCond);
+    pthread_mutex_unlock(&gPendingMutex);
+}
+
 void ui_print(const char *fmt, ...)
 {
     char buf[256];
@@ -462,37 +699,35 @@ void ui_print(const char *fmt, ...)
 
     fputs(buf, stdout);
 
-    // This can get called before ui_init(), so be careful.
-    pthread_mutex_lock(&gUpdateMutex);
-    if (text_rows > 0 && text_cols > 0) {
-        char *ptr;
-        for (ptr = buf; *ptr != '\0'; ++ptr) {
-            if (*ptr == '\n' || text_col >= text_cols) {
-                text[text_row][text_col] = '\0';
-                text_col = 0;
-                text_row = (text_row + 1) % text_rows;
-                if (text_row == text_top) text_top = (text_top + 1) % text_rows;
-            }
-            if (*ptr != '\n') text[text_row][text_col++] = *ptr;
-        }
-        text[text_row][text_col] = '\0';
-        update_screen_locked();
-    }
-    pthread_mutex_unlock(&gUpdateMutex);
+    // This can get called before ui_init(); the text just waits.
+    queue_text(buf, strlen(buf));
 }
 
 void ui_reset_text_col()
 {
-    pthread_mutex_lock(&gUpdateMutex);
-    text_col = 0;
-    pthread_mutex_unlock(&gUpdateMutex);
+    // in order with the text printed before it
+    queue_text("\r", 1);
 }
 
-#define MENU_ITEM_HEADER " - "
-#define MENU_ITEM_HEADER_LENGTH strlen(MENU_ITEM_HEADER)
+void ui_flush()
+{
+    pthread_mutex_lock(&gPendingMutex);
+    if (gRenderStarted) {
+        ++gFlushWaiters;
+        pthread_cond_signal(&gPendingCond);
+        while (gPendingLen > 0 || gPendingProgress >= 0 || gRenderBusy) {
+            pthread_cond_wait(&gFlushedCond, &gPendingMutex);
+        }
+        --gFlushWaiters;
+    }
+    pthread_mutex_unlock(&gPendingMutex);
+}
 
-int ui_start_menu(char** headers, char** items, int initial_selection) {
+int ui_start_menu_items(char** headers, int item_count,
+                        ui_menu_item_fn get_item, void* cookie,
+                        int initial_selection) {
     int i;
+    ui_flush();
     pthread_mutex_lock(&gUpdateMutex);
     if (text_rows > 0 && text_cols > 0) {
         for (i = 0; i < text_rows; ++i) {
@@ -501,34 +736,36 @@ int ui_start_menu(char** headers, char** items, int initial_selection) {
             menu[i][text_cols-1] = '\0';
         }
         menu_top = i;
-        for (; i < MENU_MAX_ROWS; ++i) {
-            if (items[i-menu_top] == NULL) break;
-            strcpy(menu[i], MENU_ITEM_HEADER);
-            strncpy(menu[i] + MENU_ITEM_HEADER_LENGTH, items[i-menu_top], text_cols-1 - MENU_ITEM_HEADER_LENGTH);
-            menu[i][text_cols-1] = '\0';
-        }
-
-        if (gShowBackButton) {
-            strcpy(menu[i], " - ---返回---");
-        }
 
-        menu_items = i - menu_top;
+        menu_get_item = get_item;
+        menu_cookie = cookie;
+        menu_back_button = gShowBackButton;
+        menu_items = item_count + (menu_back_button ? 1 : 0);
         show_menu = 1;
         menu_sel = menu_show_start = initial_selection;
         update_screen_locked();
     }
     pthread_mutex_unlock(&gUpdateMutex);
-    if (gShowBackButton) {
-        return menu_items - 1;
-    }
-    return menu_items;
+    return item_count;
+}
+
+static const char* menu_array_item(int index, void* cookie) {
+    return ((char**) cookie)[index];
+}
+
+int ui_start_menu(char** headers, char** items, int initial_selection) {
+    int count = 0;
+    while (items[count] != NULL) ++count;
+    return ui_start_menu_items(headers, count, menu_array_item, items,
+                               initial_selection);
 }
 
 int ui_menu_select(int sel) {
-    int old_sel;
+    int old_sel, old_start;
     pthread_mutex_lock(&gUpdateMutex);
     if (show_menu > 0) {
         old_sel = menu_sel;
+        old_start = menu_show_start;
         menu_sel = sel;
 
         if (menu_sel < 0) menu_sel = menu_items + menu_sel;
@@ -545,14 +782,23 @@ int ui_menu_select(int sel) {
 
         sel = menu_sel;
 
-        if (menu_sel != old_sel) update_screen_locked();
+        if (menu_sel != old_sel) {
+            if (menu_show_start != old_start) {
+                update_screen_locked();
+            } else {
+                // just move the highlight
+                int a = menu_top + old_sel - menu_show_start;
+                int b = menu_top + menu_sel - menu_show_start;
+                update_rows_locked(a < b ? a : b, a < b ? b : a);
+            }
+        }
     }
     pthread_mutex_unlock(&gUpdateMutex);
     return sel;
 }
 
 void ui_end_menu() {
-    int i;
+    ui_flush();
     pthread_mutex_lock(&gUpdateMutex);
     if (show_menu > 0 && text_rows > 0 && text_cols > 0) {
         show_menu = 0;
@@ -571,25 +817,51 @@ int ui_text_visible()
 
 void ui_show_text(int visible)
 {
+    ui_flush();
     pthread_mutex_lock(&gUpdateMutex);
     show_text = visible;
     update_screen_locked();
+    pthread_cond_signal(&gProgressCond);
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
-int ui_wait_key()
+static int wait_key(int wakeable)
 {
     pthread_mutex_lock(&key_queue_mutex);
-    while (key_queue_len == 0) {
+    while (key_queue_len == 0 && !(wakeable && key_wake)) {
         pthread_cond_wait(&key_queue_cond, &key_queue_mutex);
     }
 
-    int key = key_queue[0];
-    memcpy(&key_queue[0], &key_queue[1], sizeof(int) * --key_queue_len);
+    int key;
+    if (key_queue_len > 0) {
+        key = key_queue[0];
+        memcpy(&key_queue[0], &key_queue[1], sizeof(int) * --key_queue_len);
+    } else {
+        key = UI_WAKE;
+        key_wake = 0;
+    }
     pthread_mutex_unlock(&key_queue_mutex);
     return key;
 }
 
+int ui_wait_key()
+{
+    return wait_key(0);
+}
+
+int ui_wait_key_or_wake()
+{
+    return wait_key(1);
+}
+
+void ui_wake()
+{
+    pthread_mutex_lock(&key_queue_mutex);
+    key_wake = 1;
+    pthread_cond_signal(&key_queue_cond);
+    pthread_mutex_unlock(&key_queue_mutex);
+}
+
 int ui_key_pressed(int key)
 {
     // This is a volatile static array, don't bother locking
@@ -599,11 +871,16 @@ int ui_key_pressed(int key)
 void ui_clear_key_queue() {
     pthread_mutex_lock(&key_queue_mutex);
     key_queue_len = 0;
+    // key_wake stays: a wake isn't a stale key press, and menus clear
+    // the queue after whoever wakes them may already have done so.
     pthread_mutex_unlock(&key_queue_mutex);
 }
 
 void ui_set_show_text(int value) {
+    pthread_mutex_lock(&gUpdateMutex);
     show_text = value;
+    pthread_cond_signal(&gProgressCond);
+    pthread_mutex_unlock(&gUpdateMutex);
 }
 
 void ui_set_showing_back_button(int showBackButton) {
@@ -22,24 +22,153 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
 
-// Look for an RSA signature embedded in the .ZIP file comment given
-// the path to the zip.  Verify it matches one of the given public
-// keys.
-//
-// Return VERIFY_SUCCESS, VERIFY_FAILURE (if any error is encountered
-// or no key matches the signature).
+// The signed data is read by a separate thread into a small ring of
+// large buffers, so that the card is kept busy while the previous
+// chunk is being hashed.
+#define READ_CHUNK_SIZE   (1024*1024)
+#define READ_CHUNK_COUNT  3
 
-int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKeys) {
-    ui_set_progress(0.0);
+typedef struct {
+    int fd;
+    size_t length;                  // total bytes to read from offset 0
+    unsigned char* chunk[READ_CHUNK_COUNT];
+    size_t chunk_len[READ_CHUNK_COUNT];
+    size_t produced;                // chunks filled by the reader
+    size_t consumed;                // chunks released by the hasher
+    int error;                      // errno from the reader, or 0
+    int cancelled;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ReadAhead;
 
-    FILE* f = fopen(path, "rb");
-    if (f == NULL) {
-        LOGE("failed to open %s (%s)\n", path, strerror(errno));
-        return VERIFY_FAILURE;
+static void* read_ahead_thread(void* cookie) {
+    ReadAhead* ra = (ReadAhead*) cookie;
+    size_t pos = 0;
+
+    while (pos < ra->length) {
+        pthread_mutex_lock(&ra->lock);
+        while (ra->produced - ra->consumed == READ_CHUNK_COUNT &&
+               !ra->cancelled) {
+            pthread_cond_wait(&ra->cond, &ra->lock);
+        }
+        int cancelled = ra->cancelled;
+        pthread_mutex_unlock(&ra->lock);
+        if (cancelled) break;
+
+        int slot = ra->produced % READ_CHUNK_COUNT;
+        size_t want = ra->length - pos;
+        if (want > READ_CHUNK_SIZE) want = READ_CHUNK_SIZE;
+
+        size_t got = 0;
+        int error = 0;
+        while (got < want) {
+            ssize_t r = pread(ra->fd, ra->chunk[slot] + got, want - got,
+                              pos + got);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) {
+                error = r < 0 ? errno : EIO;
+                break;
+            }
+            got += r;
+        }
+
+        pthread_mutex_lock(&ra->lock);
+        if (error) {
+            ra->error = error;
+        } else {
+            ra->chunk_len[slot] = got;
+            ++ra->produced;
+        }
+        pthread_cond_broadcast(&ra->cond);
+        pthread_mutex_unlock(&ra->lock);
+        if (error) break;
+        pos += got;
+    }
+    return NULL;
+}
+
+// SHA-1 the first "length" bytes of fd into ctx, updating the progress
+// bar as we go.  Returns 0 on success, or an errno value.
+static int hash_file_prefix(int fd, size_t length, SHA_CTX* ctx) {
+    ReadAhead ra;
+    int i;
+
+    memset(&ra, 0, sizeof(ra));
+    ra.fd = fd;
+    ra.length = length;
+    for (i = 0; i < READ_CHUNK_COUNT; ++i) {
+        ra.chunk[i] = malloc(READ_CHUNK_SIZE);
+        if (ra.chunk[i] == NULL) {
+            while (--i >= 0) free(ra.chunk[i]);
+            return ENOMEM;
+        }
     }
+    pthread_mutex_init(&ra.lock, NULL);
+    pthread_cond_init(&ra.cond, NULL);
+
+    pthread_t reader;
+    int result = pthread_create(&reader, NULL, read_ahead_thread, &ra);
+    if (result != 0) {
+        goto done;
+    }
+
+    double frac = -1.0;
+    size_t so_far = 0;
+    while (so_far < length) {
+        pthread_mutex_lock(&ra.lock);
+        while (ra.produced == ra.consumed && ra.error == 0) {
+            pthread_cond_wait(&ra.cond, &ra.lock);
+        }
+        if (ra.produced == ra.consumed) {
+            result = ra.error;
+            ra.cancelled = 1;
+            pthread_cond_broadcast(&ra.cond);
+            pthread_mutex_unlock(&ra.lock);
+            break;
+        }
+        pthread_mutex_unlock(&ra.lock);
+
+        int slot = ra.consumed % READ_CHUNK_COUNT;
+        SHA_update(ctx, ra.chunk[slot], ra.chunk_len[slot]);
+        so_far += ra.chunk_len[slot];
 
+        pthread_mutex_lock(&ra.lock);
+        ++ra.consumed;
+        pthread_cond_broadcast(&ra.cond);
+        pthread_mutex_unlock(&ra.lock);
+
+        double f = so_far / (double)length;
+        if (f > frac + 0.02 || so_far == length) {
+            ui_set_progress(f);
+            frac = f;
+        }
+    }
+    pthread_join(reader, NULL);
+
+done:
+    pthread_cond_destroy(&ra.cond);
+    pthread_mutex_destroy(&ra.lock);
+    for (i = 0; i < READ_CHUNK_COUNT; ++i) {
+        free(ra.chunk[i]);
+    }
+    return result;
+}
+
+// Read the whole-file signature footer and the EOCD record from f.
+// On success returns VERIFY_SUCCESS, stores a malloc'd copy of the
+// EOCD record (including the comment) in *eocd_out, and stores how
+// many bytes at the start of the file are covered by the signature in
+// *signed_len_out.
+
+static int read_signature_footer(FILE* f, const char* path,
+                                 unsigned char** eocd_out,
+                                 size_t* eocd_size_out,
+                                 size_t* signed_len_out) {
     // An archive with a whole-file signature will end in six bytes:
     //
     //   (2-byte signature start) $ff $ff (2-byte comment size)
@@ -53,19 +182,16 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
 
     if (fseek(f, -FOOTER_SIZE, SEEK_END) != 0) {
         LOGE("failed to seek in %s (%s)\n", path, strerror(errno));
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
     unsigned char footer[FOOTER_SIZE];
     if (fread(footer, 1, FOOTER_SIZE, f) != FOOTER_SIZE) {
         LOGE("failed to read footer from %s (%s)\n", path, strerror(errno));
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
     if (footer[2] != 0xff || footer[3] != 0xff) {
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
@@ -77,7 +203,6 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
     if (signature_start - FOOTER_SIZE < RSANUMBYTES) {
         // "signature" block isn't big enough to contain an RSA block.
         LOGE("signature is too short\n");
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
@@ -89,7 +214,6 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
 
     if (fseek(f, -eocd_size, SEEK_END) != 0) {
         LOGE("failed to seek in %s (%s)\n", path, strerror(errno));
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
@@ -102,12 +226,11 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
     unsigned char* eocd = malloc(eocd_size);
     if (eocd == NULL) {
         LOGE("malloc for EOCD record failed\n");
-        fclose(f);
         return VERIFY_FAILURE;
     }
     if (fread(eocd, 1, eocd_size, f) != eocd_size) {
         LOGE("failed to read eocd from %s (%s)\n", path, strerror(errno));
-        fclose(f);
+        free(eocd);
         return VERIFY_FAILURE;
     }
 
@@ -116,7 +239,7 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
     if (eocd[0] != 0x50 || eocd[1] != 0x4b ||
         eocd[2] != 0x05 || eocd[3] != 0x06) {
         LOGE("signature length doesn't match EOCD marker\n");
-        fclose(f);
+        free(eocd);
         return VERIFY_FAILURE;
     }
 
@@ -129,56 +252,142 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
             // which could be exploitable.  Fail verification if
             // this sequence occurs anywhere after the real one.
             LOGE("EOCD marker occurs after start of EOCD\n");
-            fclose(f);
+            free(eocd);
             return VERIFY_FAILURE;
         }
     }
 
-#define BUFFER_SIZE 4096
-
-    SHA_CTX ctx;
-    SHA_init(&ctx);
-    unsigned char* buffer = malloc(BUFFER_SIZE);
-    if (buffer == NULL) {
-        LOGE("failed to alloc memory for sha1 buffer\n");
-        fclose(f);
-        return VERIFY_FAILURE;
-    }
+    *eocd_out = eocd;
+    *eocd_size_out = eocd_size;
+    *signed_len_out = signed_len;
+    return VERIFY_SUCCESS;
+}
 
-    double frac = -1.0;
-    size_t so_far = 0;
-    fseek(f, 0, SEEK_SET);
-    while (so_far < signed_len) {
-        int size = BUFFER_SIZE;
-        if (signed_len - so_far < size) size = signed_len - so_far;
-        if (fread(buffer, 1, size, f) != size) {
-            LOGE("failed to read data from %s (%s)\n", path, strerror(errno));
-            fclose(f);
-            return VERIFY_FAILURE;
-        }
-        SHA_update(&ctx, buffer, size);
-        so_far += size;
-        double f = so_far / (double)signed_len;
-        if (f > frac + 0.02 || size == so_far) {
-            ui_set_progress(f);
-            frac = f;
-        }
-    }
-    fclose(f);
-    free(buffer);
+// Check the RSA signature stored in the EOCD comment against the
+// SHA-1 of the signed data, trying each of the given keys.
 
-    const uint8_t* sha1 = SHA_final(&ctx);
+static int check_signature(const unsigned char* eocd, size_t eocd_size,
+                           const uint8_t* sha1,
+                           const RSAPublicKey *pKeys, unsigned int numKeys) {
+    unsigned int i;
     for (i = 0; i < numKeys; ++i) {
         // The 6 bytes is the "(signature_start) $ff $ff (comment_size)" that
         // the signing tool appends after the signature itself.
         if (RSA_verify(pKeys+i, eocd + eocd_size - 6 - RSANUMBYTES,
                        RSANUMBYTES, sha1)) {
             LOGI("whole-file signature verified\n");
-            free(eocd);
             return VERIFY_SUCCESS;
         }
     }
-    free(eocd);
     LOGE("failed to verify whole-file signature\n");
     return VERIFY_FAILURE;
 }
+
+// Look for an RSA signature embedded in the .ZIP file comment given
+// the path to the zip.  Verify it matches one of the given public
+// keys.
+//
+// Return VERIFY_SUCCESS, VERIFY_FAILURE (if any error is encountered
+// or no key matches the signature).
+
+int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKeys) {
+    ui_set_progress(0.0);
+
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        LOGE("failed to open %s (%s)\n", path, strerror(errno));
+        return VERIFY_FAILURE;
+    }
+
+    unsigned char* eocd;
+    size_t eocd_size, signed_len;
+    if (read_signature_footer(f, path, &eocd, &eocd_size,
+                              &signed_len) != VERIFY_SUCCESS) {
+        fclose(f);
+        return VERIFY_FAILURE;
+    }
+
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    int err = hash_file_prefix(fileno(f), signed_len, &ctx);
+    fclose(f);
+    if (err != 0) {
+        LOGE("failed to read data from %s (%s)\n", path, strerror(err));
+        free(eocd);
+        return VERIFY_FAILURE;
+    }
+
+    int result = check_signature(eocd, eocd_size, SHA_final(&ctx),
+                                 pKeys, numKeys);
+    free(eocd);
+    return result;
+}
+
+// Prepare to hash a package as it is streamed elsewhere.  Only the
+// footer of the file at path is read, to learn how much of the file
+// the signature covers.
+
+int verifier_hash_init(VerifierHash* vh, const char* path) {
+    SHA_init(&vh->ctx);
+    vh->signed_len = 0;
+    vh->hashed = 0;
+
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        LOGE("failed to open %s (%s)\n", path, strerror(errno));
+        return VERIFY_FAILURE;
+    }
+    unsigned char* eocd;
+    size_t eocd_size;
+    int result = read_signature_footer(f, path, &eocd, &eocd_size,
+                                       &vh->signed_len);
+    fclose(f);
+    if (result == VERIFY_SUCCESS) {
+        free(eocd);
+    }
+    return result;
+}
+
+void verifier_hash_update(VerifierHash* vh, const void* data, size_t len) {
+    if (vh->hashed >= vh->signed_len) return;
+    if (len > vh->signed_len - vh->hashed) {
+        len = vh->signed_len - vh->hashed;
+    }
+    SHA_update(&vh->ctx, data, len);
+    vh->hashed += len;
+}
+
+// Like verify_file(), but the signed data has already been fed through
+// vh.  Only the footer and EOCD of path are read; they must describe
+// exactly the range that was hashed.
+
+int verify_file_hashed(const char* path, VerifierHash* vh,
+                       const RSAPublicKey *pKeys, unsigned int numKeys) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        LOGE("failed to open %s (%s)\n", path, strerror(errno));
+        return VERIFY_FAILURE;
+    }
+
+    unsigned char* eocd;
+    size_t eocd_size, signed_len;
+    int result = read_signature_footer(f, path, &eocd, &eocd_size,
+                                       &signed_len);
+    fclose(f);
+    if (result != VERIFY_SUCCESS) {
+        return VERIFY_FAILURE;
+    }
+
+    if (signed_len != vh->signed_len || vh->hashed != signed_len) {
+        LOGE("hashed %zu of %zu signed bytes; expected %zu\n",
+             vh->hashed, vh->signed_len, signed_len);
+        free(eocd);
+        return VERIFY_FAILURE;
+    }
+
+    result = check_signature(eocd, eocd_size, SHA_final(&vh->ctx),
+                             pKeys, numKeys);
+    free(eocd);
+    ui_set_progress(1.0);
+    return result;
+}
@@ -17,13 +17,43 @@
 #ifndef _RECOVERY_VERIFIER_H
 #define _RECOVERY_VERIFIER_H
 
+#include <stddef.h>
+
 #include "mincrypt/rsa.h"
+#include "mincrypt/sha.h"
 
 /* Look in the file for a signature footer, and verify that it
  * matches one of the given keys.  Return one of the constants below.
  */
 int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKeys);
 
+/* Whole-file hash computed while the package is streamed somewhere
+ * else (e.g. copied to /tmp), so verification doesn't need its own
+ * pass over the data.
+ */
+typedef struct {
+    SHA_CTX ctx;
+    size_t signed_len;      /* bytes covered by the signature */
+    size_t hashed;          /* bytes fed to ctx so far */
+} VerifierHash;
+
+/* Read the signature footer of path and start a new hash.  Returns
+ * VERIFY_FAILURE if the file has no usable footer; the hash can still
+ * be fed, but verify_file_hashed() will fail.
+ */
+int verifier_hash_init(VerifierHash* vh, const char* path);
+
+/* Feed the next len bytes of the package; bytes past the signed
+ * range are ignored.
+ */
+void verifier_hash_update(VerifierHash* vh, const void* data, size_t len);
+
+/* Verify path against the hash fed through vh.  The footer of path
+ * must describe exactly the range that was hashed.
+ */
+int verify_file_hashed(const char* path, VerifierHash* vh,
+                       const RSAPublicKey *pKeys, unsigned int numKeys);
+
 #define VERIFY_SUCCESS        0
 #define VERIFY_FAILURE        1
 